@@ -0,0 +1,307 @@
+/****************************************************************************
+ * Microbenchmarks of kilo's row primitives
+ *
+ * Includes the editor, built with -DKILO_NO_MAIN to leave out its main(),
+ * and times single primitives across row lengths, tab densities and file
+ * sizes. Every case is calibrated to MICRO_SAMPLE_NS per sample and sampled
+ * MICRO_SAMPLES times; the median, spread and extremes are printed to stdout
+ * as JSON so runs can be compared for regressions.
+ *
+ * Usage: bench/micro [substring of the primitives to run]
+ ****************************************************************************/
+
+#include "../kilo.c"
+
+/*** defines ***/
+
+// Samples per case, and the time each sample is calibrated to take
+#define MICRO_SAMPLES 21
+#define MICRO_SAMPLE_NS 2000000LL
+
+// Edits timed between two resets of the row or file they grow
+#define MICRO_BATCH 16
+
+// Rows cycled through by the per-row primitives
+#define MICRO_ROWS 64
+
+/*** data ***/
+
+/** @struct microCase
+ *  @brief A primitive and the buffer it is timed on
+ *
+ *  @var foreignstruct::name
+ *  Member 'name' the primitive being timed
+ *
+ *  @var foreignstruct::len
+ *  Member 'len' the length of every row
+ *
+ *  @var foreignstruct::tabs
+ *  Member 'tabs' the fraction of the characters that are tabs
+ *
+ *  @var foreignstruct::rows
+ *  Member 'rows' the number of rows in the buffer
+ *
+ *  @var foreignstruct::run
+ *  Member 'run' times iters calls of the primitive, returning nanoseconds
+ */
+struct microCase {
+  const char *name;
+  int len;
+  double tabs;
+  int rows;
+  long long (*run)(struct microCase *c, long long iters);
+};
+
+// Results are added up here so the compiler cannot drop the calls
+volatile long long microSink;
+
+/*** buffers ***/
+
+/**
+ * @brief Fills a line with C-like text in which a fraction of the characters
+ * are tabs
+ *
+ * The text has no block comments, so an edit never changes how the rows
+ * after it are highlighted and every call costs about the same.
+ *
+ * @param buf the line, len bytes
+ * @param len the length of the line
+ * @param tabs the fraction of the characters that are tabs
+ * @param seed the state of the random generator
+ */
+void microLine(char *buf, int len, double tabs, unsigned *seed) {
+  static const char text[] =
+    "if (n > 42) return \"str\"; x = y + 3.5; int k = 0x1f; char c; ";
+  for (int i = 0; i < len; i++) {
+    *seed = *seed * 1103515245u + 12345u;
+    if ((*seed >> 8) % 1024 < (unsigned)(tabs * 1024)) buf[i] = '\t';
+    else buf[i] = text[(i + *seed % 7) % (sizeof(text) - 1)];
+  }
+}
+
+/**
+ * @brief Replaces the buffer with the rows a case is timed on
+ *
+ * @param c the case
+ */
+void microSetup(struct microCase *c) {
+  editorFreeBuffer();
+  E.syntax = &HLDB[0];
+  E.cx = E.cy = E.rowoff = E.coloff = 0;
+
+  char *line = malloc(c->len + 1);
+  if (line == NULL) die("malloc");
+  unsigned seed = 1;
+  for (int i = 0; i < c->rows; i++) {
+    microLine(line, c->len, c->tabs, &seed);
+    editorInsertRow(E.numrows, line, c->len);
+  }
+  free(line);
+}
+
+/*** primitives ***/
+
+long long microUpdateRow(struct microCase *c, long long iters) {
+  long long start = editorNowNs();
+  for (long long i = 0; i < iters; i++)
+    editorUpdateRow(&E.row[i % c->rows]);
+  return editorNowNs() - start;
+}
+
+long long microUpdateSyntax(struct microCase *c, long long iters) {
+  long long start = editorNowNs();
+  for (long long i = 0; i < iters; i++)
+    editorUpdateSyntax(&E.row[i % c->rows]);
+  return editorNowNs() - start;
+}
+
+long long microCxToRx(struct microCase *c, long long iters) {
+  long long sum = 0;
+  long long start = editorNowNs();
+  for (long long i = 0; i < iters; i++) {
+    erow *row = &E.row[i % c->rows];
+    sum += editorRowCxToRx(row, row->size);
+  }
+  long long ns = editorNowNs() - start;
+  microSink += sum;
+  return ns;
+}
+
+/**
+ * @brief Times characters typed into the middle of a row
+ *
+ * The row is put back every MICRO_BATCH characters, outside the time
+ * measured, so it stays within MICRO_BATCH of its length.
+ */
+long long microInsertChar(struct microCase *c, long long iters) {
+  (void)c;
+  erow *row = &E.row[0];
+  char *orig = malloc(row->size + 1);
+  if (orig == NULL) die("malloc");
+  int len = row->size;
+  memcpy(orig, row->chars, len);
+
+  long long ns = 0;
+  for (long long i = 0; i < iters; i += MICRO_BATCH) {
+    int n = iters - i < MICRO_BATCH ? iters - i : MICRO_BATCH;
+    long long start = editorNowNs();
+    for (int j = 0; j < n; j++) editorRowInsertChar(row, len / 2, 'x');
+    ns += editorNowNs() - start;
+    editorRowSet(row, orig, len);
+  }
+  free(orig);
+  return ns;
+}
+
+/**
+ * @brief Times rows inserted into the middle of the file
+ *
+ * The rows are deleted again every MICRO_BATCH rows, outside the time
+ * measured.
+ */
+long long microInsertRow(struct microCase *c, long long iters) {
+  char *line = malloc(c->len);
+  if (line == NULL) die("malloc");
+  unsigned seed = 2;
+  microLine(line, c->len, c->tabs, &seed);
+
+  long long ns = 0;
+  for (long long i = 0; i < iters; i += MICRO_BATCH) {
+    int n = iters - i < MICRO_BATCH ? iters - i : MICRO_BATCH;
+    long long start = editorNowNs();
+    for (int j = 0; j < n; j++) editorInsertRow(c->rows / 2, line, c->len);
+    ns += editorNowNs() - start;
+    editorDelRows(c->rows / 2, n);
+  }
+  free(line);
+  return ns;
+}
+
+long long microRowsToString(struct microCase *c, long long iters) {
+  (void)c;
+  long long start = editorNowNs();
+  for (long long i = 0; i < iters; i++) {
+    int len;
+    char *buf = editorRowsToString(&len);
+    microSink += len;
+    free(buf);
+  }
+  return editorNowNs() - start;
+}
+
+long long microDrawRows(struct microCase *c, long long iters) {
+  (void)c;
+  long long start = editorNowNs();
+  for (long long i = 0; i < iters; i++) {
+    struct abuf ab = ABUF_INIT;
+    editorDrawRows(&ab);
+    microSink += ab.len;
+    abFree(&ab);
+  }
+  return editorNowNs() - start;
+}
+
+/*** statistics ***/
+
+int microCmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Times a case and prints its statistics as a JSON object
+ *
+ * The number of calls per sample is calibrated so a sample takes about
+ * MICRO_SAMPLE_NS, which keeps clock overhead and jitter small next to the
+ * time measured. One sample is thrown away to warm up caches. Times are per
+ * call, in nanoseconds.
+ *
+ * @param c the case
+ * @param first whether this is the first case printed
+ */
+void microRun(struct microCase *c, int first) {
+  microSetup(c);
+
+  long long iters = 1, ns;
+  while ((ns = c->run(c, iters)) < MICRO_SAMPLE_NS / 8) iters *= 2;
+  iters = iters * MICRO_SAMPLE_NS / (ns > 0 ? ns : 1);
+  if (iters < 1) iters = 1;
+  c->run(c, iters);
+
+  double t[MICRO_SAMPLES], dev[MICRO_SAMPLES];
+  for (int i = 0; i < MICRO_SAMPLES; i++)
+    t[i] = (double)c->run(c, iters) / iters;
+  qsort(t, MICRO_SAMPLES, sizeof(double), microCmp);
+  double median = t[MICRO_SAMPLES / 2];
+  for (int i = 0; i < MICRO_SAMPLES; i++)
+    dev[i] = t[i] > median ? t[i] - median : median - t[i];
+  qsort(dev, MICRO_SAMPLES, sizeof(double), microCmp);
+
+  printf("%s    {\"name\": \"%s\", \"len\": %d, \"tabs\": %.4f, "
+         "\"rows\": %d, \"iters\": %lld, \"samples\": %d, "
+         "\"median_ns\": %.2f, \"mad_ns\": %.2f, \"min_ns\": %.2f, "
+         "\"max_ns\": %.2f}", first ? "" : ",\n", c->name, c->len, c->tabs,
+         c->rows, iters, MICRO_SAMPLES, median, dev[MICRO_SAMPLES / 2], t[0],
+         t[MICRO_SAMPLES - 1]);
+  fflush(stdout);
+  fprintf(stderr, "%-20s len %5d tabs %.3f rows %6d  %12.1f ns\n", c->name,
+          c->len, c->tabs, c->rows, median);
+}
+
+/*** init ***/
+
+int main(int argc, char *argv[]) {
+  const char *filter = argc > 1 ? argv[1] : "";
+  static const int lens[] = { 16, 80, 1000 };
+  static const double tabs[] = { 0, 1.0 / 16, 1.0 / 4 };
+  static const int sizes[] = { 1000, 10000, 100000 };
+  static const struct {
+    const char *name;
+    long long (*run)(struct microCase *c, long long iters);
+  } perrow[] = {
+    { "editorUpdateRow", microUpdateRow },
+    { "editorUpdateSyntax", microUpdateSyntax },
+    { "editorRowInsertChar", microInsertChar },
+    { "editorRowCxToRx", microCxToRx },
+  };
+
+  // Rows are only drawn onto a fixed 24x80 screen, as in headless runs
+  E.headless = calloc(1, sizeof(*E.headless));
+  if (E.headless == NULL) die("calloc");
+  initEditor();
+
+  struct microCase cases[64];
+  int n = 0;
+  for (size_t p = 0; p < sizeof(perrow) / sizeof(perrow[0]); p++)
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+      for (size_t t = 0; t < sizeof(tabs) / sizeof(tabs[0]); t++)
+        cases[n++] = (struct microCase){ perrow[p].name, lens[l], tabs[t],
+                                         MICRO_ROWS, perrow[p].run };
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    cases[n++] = (struct microCase){ "editorInsertRow", 80, 1.0 / 16,
+                                     sizes[s], microInsertRow };
+    cases[n++] = (struct microCase){ "editorRowsToString", 80, 1.0 / 16,
+                                     sizes[s], microRowsToString };
+  }
+  for (size_t t = 0; t < sizeof(tabs) / sizeof(tabs[0]); t++)
+    cases[n++] = (struct microCase){ "editorDrawRows", 80, tabs[t], 1000,
+                                     microDrawRows };
+
+  int simd = 0;
+#ifdef KILO_HAVE_SSE2
+  simd = 1;
+#endif
+  printf("{\n  \"kilo_version\": \"%s\",\n  \"compiler\": \"%s\",\n"
+         "  \"simd\": %d,\n  \"time\": %lld,\n  \"benchmarks\": [\n",
+         KILO_VERSION, __VERSION__, simd, (long long)time(NULL));
+  int first = 1;
+  for (int i = 0; i < n; i++) {
+    if (strstr(cases[i].name, filter) == NULL) continue;
+    microRun(&cases[i], first);
+    first = 0;
+  }
+  printf("\n  ]\n}\n");
+
+  editorFreeBuffer();
+  return 0;
+}
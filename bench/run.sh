@@ -0,0 +1,55 @@
+#!/bin/sh
+# Replays standard editing workloads through kilo's headless mode and prints
+# the latency of the keys of each one.
+#
+# Usage: bench/run.sh [path to kilo]
+# BENCH_MB sets the size of the file the workloads run on (default 1024).
+
+set -e
+KILO=${1:-./kilo}
+MB=${BENCH_MB:-1024}
+DIR=${TMPDIR:-/tmp}/kilo-bench.$$
+mkdir -p "$DIR"
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+# 1 MB of build-log-like lines, one in a thousand holding a needle to search
+# for, repeated up to the size of the big file
+awk 'BEGIN {
+  srand(1);
+  while (n < 1048576) {
+    i++;
+    if (i % 1000 == 0) line = sprintf("%06d needle found in src/mod%d.c", i, i % 97);
+    else line = sprintf("%06d gcc -O2 -Wall -c src/mod%d.c -o build/mod%d.o # %d", i, i % 97, i % 97, int(rand() * 1e6));
+    print line;
+    n += length(line) + 1;
+  }
+}' > "$DIR/chunk"
+i=0
+while [ "$i" -lt "$MB" ]; do cat "$DIR/chunk"; i=$((i + 1)); done > "$DIR/big.log"
+
+# Keys: Enter is \r, Ctrl-F is \006, Ctrl-S is \023 and arrow down is ESC [ B
+: > "$DIR/open.keys"
+LC_ALL=C tr -dc 'a-z ' < /dev/urandom | head -c 10000 | fold -w 70 |
+  tr '\n' '\r' > "$DIR/type.keys"
+head -c 1048576 "$DIR/chunk" | tr '\n' '\r' > "$DIR/paste.keys"
+printf '\006needle\033[B\033[B\033[B\033[B\033[B\r' > "$DIR/search.keys"
+printf 'x\023' > "$DIR/save.keys"
+
+# Runs one workload on a fresh copy of a file
+run() {
+  echo "== $1 ($2)"
+  cp "$DIR/$2" "$DIR/work.log"
+  "$KILO" --headless "$DIR/$1.keys" "$DIR/work.log" 2>&1
+  rm -f "$DIR/work.log" "$DIR/.work.log.kilo-journal"
+}
+
+# Pasting goes into an empty file: every pasted line inserts a row, which
+# costs time in proportion to the rows after it
+: > "$DIR/empty.log"
+
+echo "kilo headless benchmark, $MB MB file"
+run open big.log
+run type big.log
+run paste empty.log
+run search big.log
+run save big.log
@@ -14,26 +14,130 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+// macOS names the nanosecond stat() timestamps differently
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+// io_uring is used for file I/O when the headers are available, unless
+// built with -DKILO_NO_IO_URING
+#if defined(__linux__) && !defined(KILO_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define KILO_HAVE_IO_URING
+#endif
+#endif
+
+// Search filters 16 positions at a time with SSE2 where the compiler offers
+// it, unless built with -DKILO_NO_SIMD
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(KILO_NO_SIMD)
+#include <emmintrin.h>
+#define KILO_HAVE_SSE2
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
 
+// 1 fsyncs the saved file and its directory before reporting success, 0 skips
+// both and only relies on the atomic rename
+#define KILO_DURABLE_SAVE 1
+
+// 1 lets a save rewrite only the changed rows in place when the rest of the
+// file stays where it is, 0 always rewrites the whole file atomically
+#define KILO_INCREMENTAL_SAVE 1
+
+// Number of idle read timeouts (1/10th of a second each) without a new
+// SIGWINCH before a resize burst is considered finished
+#define KILO_RESIZE_SETTLE_TICKS 1
+
+// Size of the screen drawn in headless mode, status and message bars included
+#define KILO_HEADLESS_ROWS 24
+#define KILO_HEADLESS_COLS 80
+
+
+// Row storage pool: slab size and the largest request served from a size class
+#define ROWPOOL_SLAB_SIZE (64 * 1024)
+#define ROWPOOL_MAX_SMALL 4096
+#define ROWPOOL_CLASSES 31
+#define ROWPOOL_LARGE 0xff
+
+// Most children of a row tree node, and the deepest a row tree can get
+#define ROWTREE_FANOUT 64
+#define ROWTREE_MAX_DEPTH 16
+
+// Most iovecs handed to a single writev() call
+#ifdef IOV_MAX
+#define KILO_IOV_BATCH IOV_MAX
+#else
+#define KILO_IOV_BATCH 1024
+#endif
+
+// io_uring: size of each read, and how many reads or writes are kept in flight
+#define KILO_URING_CHUNK (1 << 20)
+#define KILO_URING_DEPTH 8
+#define KILO_URING_UNAVAILABLE -2
+
+// Undo: bytes of history kept, and the longest pause between two keys of the
+// same kind that are still undone together
+#define KILO_UNDO_BUDGET (256 * 1024 * 1024)
+#define KILO_UNDO_COALESCE_MS 1000
+
+// Crash-recovery journal: the most bytes of records per frame, and the size
+// past which the journal is compacted (once it is also larger than twice the
+// text it last started from)
+#define KILO_JOURNAL_FRAME (1 << 20)
+#define KILO_JOURNAL_COMPACT (1 << 20)
+
+// Search: the most worker threads, and the number of rows handed to a worker
+// at a time
+#define KILO_SEARCH_MAX_THREADS 16
+#define KILO_SEARCH_CHUNK 8192
+
+// Regex search: the most DFA states a thread caches before starting over
+#define KILO_REGEX_DFA_STATES 1024
+
+// Trigram index: the fewest rows a file needs to get one, 0 to never build
+// it, and the size of each row's trigram signature in bits (a multiple of 64)
+#define KILO_TRIGRAM_MIN_ROWS 65536
+#define KILO_TRIGRAM_BITS 256
+#define KILO_TRIGRAM_WORDS (KILO_TRIGRAM_BITS / 64)
+
+// Latency histograms: buckets per power of two of nanoseconds, as a power of
+// two. 5 keeps every recorded time within 1/32 of the real one
+#define KILO_LATENCY_SUB_BITS 5
+#define KILO_LATENCY_SUB (1 << KILO_LATENCY_SUB_BITS)
+#define KILO_LATENCY_BUCKETS ((64 - KILO_LATENCY_SUB_BITS) * KILO_LATENCY_SUB)
+
+// Tracing: the number of spans kept for --trace, a power of two. Older spans
+// are overwritten
+#define KILO_TRACE_EVENTS (1 << 16)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -65,6 +169,65 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Per-row flags kept in E.rowflags
+#define ROW_OPEN_COMMENT (1<<0)
+#define ROW_SIGNED (1<<1)
+
+// Edit records in the crash-recovery journal, one per row primitive
+enum journalOp {
+  JOURNAL_RESET = 1,
+  JOURNAL_INSERT_ROW,
+  JOURNAL_DEL_ROW,
+  JOURNAL_INSERT_CHAR,
+  JOURNAL_DEL_CHAR,
+  JOURNAL_APPEND,
+  JOURNAL_TRUNCATE,
+  JOURNAL_INSERT_STRING,
+  JOURNAL_DEL_RANGE,
+  JOURNAL_INSERT_ROWS,
+  JOURNAL_DEL_ROWS,
+  JOURNAL_SET_ROW
+};
+
+// Kinds of keys whose edits are undone together when they follow each other
+enum undoKind {
+  UNDO_KIND_NONE = 0,
+  UNDO_KIND_TYPE,
+  UNDO_KIND_DELETE,
+  UNDO_KIND_REPLACE
+};
+
+// Records in the undo history
+enum undoOp {
+  UNDO_GROUP = 1,
+  UNDO_INSERT,
+  UNDO_DELETE,
+  UNDO_INSERT_ROWS,
+  UNDO_DELETE_ROWS
+};
+
+#define UNDO_NOREC SIZE_MAX
+
+// Kinds of memory accounted for by the memory report
+enum memCategory {
+  MEM_CHARS = 0,
+  MEM_RENDER,
+  MEM_HL,
+  MEM_RETIRED,
+  MEM_ROWS,
+  MEM_ABUF,
+  MEM_CATEGORIES
+};
+
+// Phases of handling a key whose latency is recorded
+enum latencyPhase {
+  LATENCY_KEY = 0,
+  LATENCY_SYNTAX,
+  LATENCY_DRAW,
+  LATENCY_FLUSH,
+  LATENCY_PHASES
+};
+
 
 /*** data ***/
 
@@ -72,6 +235,10 @@ enum editorHighlight {
  *  @brief erow stands for "editor row" and stores a line of text as a pointer to a 
  * dynamically-allocated character data and a size
  * 
+ *  The sizes are mirrored into E.rowsize and E.rowrsize, and the row's flags
+ * live in E.rowflags, so passes over the whole file can stream through
+ * contiguous arrays instead of touching every erow.
+ * 
  *  @var foreignstruct::size
  *  Member 'size' contains the size of the char array representing raw text data
  * 
@@ -87,6 +254,16 @@ enum editorHighlight {
  * 
  *  @var foreignstruct::hl
  *  Member 'hl' stores the highlighting of each line in an array
+ * 
+ *  @var foreignstruct::tabs
+ *  Member 'tabs' indexes the position of every tab in the row, NULL if it has none
+ * 
+ *  @var foreignstruct::ntabs
+ *  Member 'ntabs' contains the number of entries in tabs
+ * 
+ *  @var foreignstruct::gen
+ *  Member 'gen' the buffer generation in which chars was allocated, used to
+ * tell whether a snapshot may still be reading it
  */
 typedef struct erow {
   int idx;
@@ -95,9 +272,304 @@ typedef struct erow {
   char *chars;
   char *render;
   unsigned char *hl;
-  int hl_open_comment;
+  struct rowTab *tabs;
+  int ntabs;
+  int gen;
 } erow;
 
+/** @struct rowTab
+ *  @brief A checkpoint mapping a tab in chars to its place in render
+ * 
+ *  Between two tabs chars and render advance one column at a time, so the tab
+ *  positions alone are enough to convert between cx and rx in O(log ntabs).
+ * 
+ *  @var foreignstruct::cx
+ *  Member 'cx' contains the index of the tab in chars
+ * 
+ *  @var foreignstruct::rx
+ *  Member 'rx' contains the render column just past the tab's padding
+ */
+typedef struct rowTab {
+  int cx;
+  int rx;
+} rowTab;
+
+/** @struct rowPool
+ *  @brief A size-class slab allocator that owns the chars, render and hl arrays
+ * of every row in the buffer
+ * 
+ *  Small requests are carved from large slabs and recycled through per-class
+ * free lists. Every block is prefixed by a single byte holding its size class,
+ * so a block costs one byte of bookkeeping instead of a full malloc header.
+ * Blocks are only byte aligned. Requests above ROWPOOL_MAX_SMALL fall back to
+ * malloc but stay linked into the pool so the whole buffer can be released at
+ * once.
+ * 
+ *  @var foreignstruct::slabs
+ *  Member 'slabs' a linked list of every slab owned by the pool
+ * 
+ *  @var foreignstruct::bump
+ *  Member 'bump' the next unused byte of the newest slab
+ * 
+ *  @var foreignstruct::bump_left
+ *  Member 'bump_left' the number of unused bytes left in the newest slab
+ * 
+ *  @var foreignstruct::free
+ *  Member 'free' a free list of recycled blocks for every size class
+ * 
+ *  @var foreignstruct::large
+ *  Member 'large' a doubly linked list of the blocks that came from malloc
+ */
+struct rowPool {
+  struct rowPoolSlab *slabs;
+  char *bump;
+  size_t bump_left;
+  char *free[ROWPOOL_CLASSES];
+  struct rowPoolLarge *large;
+};
+
+struct rowPoolSlab {
+  struct rowPoolSlab *next;
+};
+
+struct rowPoolLarge {
+  struct rowPoolLarge *prev;
+  struct rowPoolLarge *next;
+  size_t cap;
+};
+
+/** @struct undoStack
+ *  @brief A stack of undo records packed back to back into one array
+ * 
+ *  Every record is an undoRecord header, its payload padded to a multiple of
+ * four bytes, and an int trailer holding the size of the whole record so the
+ * stack can be walked from the top.
+ */
+struct undoStack {
+  char *b;
+  size_t len;
+  size_t cap;
+};
+
+/** @struct undoRecord
+ *  @brief The header of an undo record
+ * 
+ *  @var foreignstruct::op
+ *  Member 'op' the UNDO_* operation
+ * 
+ *  @var foreignstruct::row
+ *  Member 'row' the row edited, or for UNDO_GROUP the cursor row before it
+ * 
+ *  @var foreignstruct::at
+ *  Member 'at' the column edited, the number of rows for UNDO_INSERT_ROWS and
+ * UNDO_DELETE_ROWS, or for UNDO_GROUP the cursor column before it
+ * 
+ *  @var foreignstruct::len
+ *  Member 'len' the length of the payload: the text, a row blob for the row
+ * operations, or the cursor after the group for UNDO_GROUP
+ */
+struct undoRecord {
+  int op;
+  int row;
+  int at;
+  int len;
+};
+
+/** @struct undoState
+ *  @brief The undo and redo history
+ * 
+ *  The row primitives record what they change while a group is open, merging
+ * into the previous record where they can: a run of typed characters becomes
+ * one UNDO_INSERT, and text typed after a newline extends the UNDO_INSERT_ROWS
+ * that added the row. Undoing a group replays its records backwards onto the
+ * redo stack.
+ * 
+ *  @var foreignstruct::budget
+ *  Member 'budget' the most bytes of undo history kept
+ * 
+ *  @var foreignstruct::kind
+ *  Member 'kind' the UNDO_KIND_* of the open group, UNDO_KIND_NONE if closed
+ * 
+ *  @var foreignstruct::group
+ *  Member 'group' the offset of the open group's UNDO_GROUP record, or
+ * UNDO_NOREC until the group records its first edit
+ * 
+ *  @var foreignstruct::last
+ *  Member 'last' the offset of the open group's last record, or UNDO_NOREC
+ * 
+ *  @var foreignstruct::lastrow
+ *  Member 'lastrow' the offset in the last record's payload of its last row
+ * when it is an UNDO_INSERT_ROWS
+ * 
+ *  @var foreignstruct::time
+ *  Member 'time' when the open group last grew
+ * 
+ *  @var foreignstruct::cx
+ *  Member 'cx' the cursor column when the open group began
+ * 
+ *  @var foreignstruct::cy
+ *  Member 'cy' the cursor row when the open group began
+ * 
+ *  @var foreignstruct::ex
+ *  Member 'ex' the cursor column where the open group left it
+ * 
+ *  @var foreignstruct::ey
+ *  Member 'ey' the cursor row where the open group left it
+ * 
+ *  @var foreignstruct::dropped
+ *  Member 'dropped' set when the open group outgrew the budget on its own and
+ * is no longer recorded
+ */
+struct undoState {
+  struct undoStack undo;
+  struct undoStack redo;
+  size_t budget;
+  int kind;
+  size_t group;
+  size_t last;
+  size_t lastrow;
+  long long time;
+  int cx;
+  int cy;
+  int ex;
+  int ey;
+  int dropped;
+};
+
+/** @struct latencyHist
+ *  @brief A log-linear histogram of the times one phase took
+ * 
+ *  Times below KILO_LATENCY_SUB nanoseconds get a bucket each; above that
+ * every power of two is split into KILO_LATENCY_SUB equal buckets, so the
+ * histogram covers any time with the same relative precision in a fixed
+ * amount of memory.
+ * 
+ *  @var foreignstruct::count
+ *  Member 'count' the number of times recorded
+ * 
+ *  @var foreignstruct::max
+ *  Member 'max' the longest time recorded, in nanoseconds
+ * 
+ *  @var foreignstruct::buckets
+ *  Member 'buckets' the number of times recorded in each bucket
+ */
+struct latencyHist {
+  long long count;
+  long long max;
+  uint32_t buckets[KILO_LATENCY_BUCKETS];
+};
+
+/** @struct latencyState
+ *  @brief The latency histograms of every phase
+ * 
+ *  @var foreignstruct::hist
+ *  Member 'hist' a histogram per latencyPhase
+ * 
+ *  @var foreignstruct::keystart
+ *  Member 'keystart' when the key being handled was read, 0 between keys
+ * 
+ *  @var foreignstruct::show
+ *  Member 'show' whether the status bar shows the latencies
+ * 
+ *  @var foreignstruct::shown
+ *  Member 'shown' whether they were ever shown, so they are printed on exit
+ */
+struct latencyState {
+  struct latencyHist hist[LATENCY_PHASES];
+  long long keystart;
+  int show;
+  int shown;
+};
+
+/** @struct memStats
+ *  @brief Counters of the append buffer, which only lives for one frame
+ * 
+ *  @var foreignstruct::appends
+ *  Member 'appends' the reallocations of the frame being drawn
+ * 
+ *  @var foreignstruct::last
+ *  Member 'last' the size of the last frame drawn
+ * 
+ *  @var foreignstruct::lastappends
+ *  Member 'lastappends' the reallocations of the last frame drawn
+ * 
+ *  @var foreignstruct::peak
+ *  Member 'peak' the size of the largest frame drawn
+ * 
+ *  @var foreignstruct::shown
+ *  Member 'shown' whether the memory report was asked for, so it is printed
+ * on exit
+ */
+struct memStats {
+  int appends;
+  int last;
+  int lastappends;
+  int peak;
+  int shown;
+};
+
+/** @struct memUsage
+ *  @brief The memory of one memCategory
+ * 
+ *  @var foreignstruct::bytes
+ *  Member 'bytes' the bytes in use
+ * 
+ *  @var foreignstruct::reserved
+ *  Member 'reserved' the bytes allocated for them, bookkeeping included
+ * 
+ *  @var foreignstruct::allocs
+ *  Member 'allocs' the number of allocations they live in
+ */
+struct memUsage {
+  long long bytes;
+  long long reserved;
+  long long allocs;
+};
+
+/** @struct rowNode
+ *  @brief A node of the row tree, a persistent B-tree of every row's text
+ * 
+ *  The row tree mirrors the chars and size of every row so that snapshots
+ * can share it. Nodes are reference counted and never modified while shared,
+ * so a snapshot is just a reference to a root.
+ * 
+ *  @var foreignstruct::refs
+ *  Member 'refs' the number of parents and snapshots pointing at the node
+ * 
+ *  @var foreignstruct::leaf
+ *  Member 'leaf' whether ptr holds row text rather than child nodes
+ * 
+ *  @var foreignstruct::n
+ *  Member 'n' the number of entries in ptr and num
+ * 
+ *  @var foreignstruct::count
+ *  Member 'count' the number of rows below the node
+ * 
+ *  @var foreignstruct::ptr
+ *  Member 'ptr' the chars of each row in a leaf, the children otherwise
+ * 
+ *  @var foreignstruct::num
+ *  Member 'num' the size of each row in a leaf, the row count of each child
+ * otherwise
+ */
+struct rowNode {
+  int refs;
+  int leaf;
+  int n;
+  int count;
+  void *ptr[ROWTREE_FANOUT];
+  int num[ROWTREE_FANOUT];
+};
+
+/** @struct rowIter
+ *  @brief A position in a snapshot, for reading its rows in order
+ */
+struct rowIter {
+  struct rowNode *node[ROWTREE_MAX_DEPTH];
+  int pos[ROWTREE_MAX_DEPTH];
+  int depth;
+};
+
 /** @struct editorConfig
  *  @brief Stores the global state of the editor
  * 
@@ -122,6 +594,26 @@ typedef struct erow {
  *  @var foreignstruct::erow
  *  Member 'erow' contains raw text data and render buffer of the text editor
  * 
+ *  @var foreignstruct::rowsize
+ *  Member 'rowsize' contains the size of every row, parallel to row
+ * 
+ *  @var foreignstruct::rowrsize
+ *  Member 'rowrsize' contains the render size of every row, parallel to row
+ * 
+ *  @var foreignstruct::rowflags
+ *  Member 'rowflags' contains the ROW_* flags of every row, parallel to row
+ * 
+ *  @var foreignstruct::rowdiskoff
+ *  Member 'rowdiskoff' contains the offset of every row in the file on disk, or
+ * -1 if the row was changed since the file was last read or written
+ * 
+ *  @var foreignstruct::rowsig
+ *  Member 'rowsig' contains KILO_TRIGRAM_WORDS words of trigram signature for
+ * every row, parallel to row, or NULL without a trigram index
+ * 
+ *  @var foreignstruct::rowcap
+ *  Member 'rowcap' contains the number of rows the row arrays have room for
+ * 
  *  @var foreignstruct::dirty
  *  Member 'dirty' contains a measure of how many changes have been made to the doc
  * since last save
@@ -138,6 +630,66 @@ typedef struct erow {
  *  @var foreignstruct::orig_termios
  *  Member 'orig_termios' contains the original terminal attributes to be modified
  * 
+ *  @var foreignstruct::winch_pending
+ *  Member 'winch_pending' is set by the SIGWINCH handler when the terminal is resized
+ * 
+ *  @var foreignstruct::resize_ticks
+ *  Member 'resize_ticks' counts quiet read timeouts left before applying a resize
+ * 
+ *  @var foreignstruct::pool
+ *  Member 'pool' owns the text, render and highlight memory of every row
+ * 
+ *  @var foreignstruct::rowtree
+ *  Member 'rowtree' the root of the row tree, NULL until the first snapshot
+ * 
+ *  @var foreignstruct::gen
+ *  Member 'gen' the current buffer generation, bumped by every snapshot
+ * 
+ *  @var foreignstruct::snapgen
+ *  Member 'snapgen' the generation of the newest live snapshot, -1 if none
+ * 
+ *  @var foreignstruct::snapshots
+ *  Member 'snapshots' the number of live snapshots
+ * 
+ *  @var foreignstruct::retired
+ *  Member 'retired' row text that was replaced while a snapshot could still
+ * read it, freed once the last snapshot is released
+ * 
+ *  @var foreignstruct::save
+ *  Member 'save' the background save in progress, NULL if there is none
+ * 
+ *  @var foreignstruct::disk
+ *  Member 'disk' the stat of the file as last read or written by the editor
+ * 
+ *  @var foreignstruct::disk_valid
+ *  Member 'disk_valid' whether disk and rowdiskoff describe the file on disk
+ * 
+ *  @var foreignstruct::journal
+ *  Member 'journal' the crash-recovery journal of unsaved edits, NULL if none
+ * 
+ *  @var foreignstruct::undo
+ *  Member 'undo' the undo and redo history
+ * 
+ *  @var foreignstruct::search
+ *  Member 'search' the match sets of the search prompt, NULL when it is closed
+ * 
+ *  @var foreignstruct::trigram
+ *  Member 'trigram' the trigram index of the buffer, NULL if there is none
+ * 
+ *  @var foreignstruct::headless
+ *  Member 'headless' the key latencies of a scripted run, NULL when running
+ * on a terminal. Set up by main() before initEditor()
+ * 
+ *  @var foreignstruct::latency
+ *  Member 'latency' the latency histograms of handling keys and drawing
+ * 
+ *  @var foreignstruct::trace
+ *  Member 'trace' the spans recorded for --trace, NULL when not tracing. Set
+ * up by main() before initEditor()
+ * 
+ *  @var foreignstruct::mem
+ *  Member 'mem' the append buffer counters of the memory report
+ * 
  */
 struct editorConfig {
   int cx, cy;
@@ -148,12 +700,39 @@ struct editorConfig {
   int screencols;
   int numrows;
   erow *row;
+  int *rowsize;
+  int *rowrsize;
+  unsigned char *rowflags;
+  off_t *rowdiskoff;
+  uint64_t *rowsig;
+  int rowcap;
   int dirty;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
   struct termios orig_termios;
+  volatile sig_atomic_t winch_pending;
+  int resize_ticks;
+  struct rowPool pool;
+  struct rowNode *rowtree;
+  int gen;
+  int snapgen;
+  int snapshots;
+  char **retired;
+  int nretired;
+  int retiredcap;
+  struct saveJob *save;
+  struct stat disk;
+  int disk_valid;
+  struct journal *journal;
+  struct undoState undo;
+  struct search *search;
+  struct trigramIndex *trigram;
+  struct headless *headless;
+  struct latencyState latency;
+  struct trace *trace;
+  struct memStats mem;
 };
 
 struct editorConfig E;
@@ -211,6 +790,32 @@ void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen(void);
 char *editorPrompt(char *prompt, void (*callback)(char*, int));
 void editorFindCallback(char *query, int key);
+void editorPollEvents(void);
+void editorWaitSave(void);
+void editorTrigramStop(void);
+void editorTrigramPoll(void);
+void editorPollSave(void);
+void editorJournalRecord(int op, int row, int at, const char *s, size_t len);
+void editorJournalPoll(void);
+void editorJournalSaveStarted(void);
+void editorJournalSaveFinished(int ok, struct stat *st, off_t len);
+void editorJournalOpen(void);
+void editorUndoInsert(int row, int at, const char *s, size_t len);
+void editorUndoDelete(int row, int at, const char *s, size_t len);
+void editorUndoInsertRows(int at, int n);
+void editorUndoDeleteRows(int at, int n);
+void editorUndoReset(void);
+void editorUndoBegin(int kind);
+void editorUndoEnd(void);
+void editorUndo(void);
+void editorRedo(void);
+void editorJournalClose(int discard);
+void editorSearchPoll(void);
+void editorHeadlessKey(void);
+void editorHeadlessFinish(void);
+long long editorNowNs(void);
+long long editorTraceBegin(void);
+void editorTraceEnd(const char *name, const char *cat, long long start);
 
 /*** terminal ***/
 
@@ -265,17 +870,14 @@ void enableRawMode(void) {
 }
 
 /**
- * @brief Reads in raw input from the user, and appropriately detects special keys
+ * @brief Translates the first byte of a key into the key
  * 
- * The input from the user is read char by char and translated into bytes.
+ * Escape sequences are read to the end, so special keys come out as a single
+ * editorKey.
+ * 
+ * @param c the first byte of the key
  */
-int editorReadKey(void) {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
-
+int editorDecodeKey(char c) {
   if (c == '\x1b') {
     char seq[3];
 
@@ -319,6 +921,27 @@ int editorReadKey(void) {
   }
 }
 
+/**
+ * @brief Reads in raw input from the user, and appropriately detects special keys
+ * 
+ * The input from the user is read char by char and translated into bytes.
+ */
+int editorReadKey(void) {
+  int nread;
+  char c;
+  if (E.headless) editorHeadlessKey();
+  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread == 0 && E.headless) editorHeadlessFinish();
+    if (nread == 0) editorPollEvents();
+  }
+
+  long long start = editorTraceBegin();
+  int key = editorDecodeKey(c);
+  editorTraceEnd("decode", "input", start);
+  return key;
+}
+
 
 /**
  * @brief Determines the current x and y position of the cursor.
@@ -371,80 +994,690 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** syntax highlighting ***/
+/**
+ * @brief Recomputes E.screenrows and E.screencols from the terminal size
+ * 
+ * Two rows are reserved for the status and message bars. Row render caches
+ * do not depend on the window size, so nothing else has to be rebuilt; the
+ * next editorScroll() pulls the cursor back into the new viewport.
+ */
+int editorUpdateWindowSize(void) {
+  int rows = KILO_HEADLESS_ROWS, cols = KILO_HEADLESS_COLS;
+  if (E.headless == NULL && getWindowSize(&rows, &cols) == -1) return -1;
+
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  if (E.screenrows < 1) E.screenrows = 1;
+  if (E.screencols < 1) E.screencols = 1;
+  return 0;
+}
 
 /**
- * @brief Identifies seperator charcters
+ * @brief Signal handler for SIGWINCH
  * 
- * strchr() returns a pointer to the first matching char of a string.
+ * Only records that a resize happened. The relayout itself is done by
+ * editorPollResize() outside of signal context.
  * 
- * @param c a char to identify
+ * @param sig the signal number (unused)
  */
-int is_separator(int c) {
-  return isspace(c) || c == "\0" || strchr(",.()+-/*=~%<>[];", c) != NULL;
+void editorHandleSigWinch(int sig) {
+  (void)sig;
+  E.winch_pending = 1;
 }
 
+/**
+ * @brief Applies a pending terminal resize once the resize burst settles.
+ * 
+ * Called by editorReadKey() every time read() times out without input. Window
+ * managers can deliver dozens of SIGWINCHs while a window is dragged, so the
+ * viewport is only recomputed and repainted after KILO_RESIZE_SETTLE_TICKS
+ * quiet timeouts, giving exactly one full repaint per burst.
+ */
+void editorPollResize(void) {
+  if (E.winch_pending) {
+    E.winch_pending = 0;
+    E.resize_ticks = KILO_RESIZE_SETTLE_TICKS;
+    return;
+  }
+  if (E.resize_ticks == 0) return;
+  if (--E.resize_ticks > 0) return;
+
+  if (editorUpdateWindowSize() == -1) return;
+  editorRefreshScreen();
+}
 
 /**
- * @brief Goes through the characters of an erow and highlights them all
+ * @brief Handles everything that happens while the editor waits for input
  * 
- * @param row the erow we want to highlight
+ * Called by editorReadKey() whenever read() times out.
  */
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-  if (E.syntax == NULL) return;
-  char **keywords = E.syntax->keywords;
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
+void editorPollEvents(void) {
+  editorPollResize();
+  editorPollSave();
+  editorJournalPoll();
+  editorSearchPoll();
+  editorTrigramPoll();
+}
+
+/*** row storage ***/
+
+// Block sizes of each size class, the one byte class tag included
+const unsigned short rowPoolClassSize[ROWPOOL_CLASSES] = {
+  16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320,
+  384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072,
+  3584, 4096
+};
+
+/**
+ * @brief Finds the smallest size class that can hold n bytes after the tag
+ * 
+ * @param n the number of bytes requested
+ */
+int rowPoolClassOf(size_t n) {
+  int lo = 0, hi = ROWPOOL_CLASSES - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if ((size_t)rowPoolClassSize[mid] - 1 < n) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief Returns the number of bytes usable in a block returned by the pool
+ * 
+ * @param p a block returned by rowPoolAlloc() or rowPoolRealloc()
+ */
+size_t rowPoolCapacity(void *p) {
+  unsigned char tag = ((unsigned char *)p)[-1];
+  if (tag == ROWPOOL_LARGE)
+    return ((struct rowPoolLarge *)((char *)p - 1) - 1)->cap;
+  return rowPoolClassSize[tag] - 1;
+}
+
+/**
+ * @brief Returns the number of bytes a block takes up, bookkeeping included
+ * 
+ * @param p a block returned by rowPoolAlloc() or rowPoolRealloc()
+ */
+size_t rowPoolBlockSize(void *p) {
+  unsigned char tag = ((unsigned char *)p)[-1];
+  if (tag == ROWPOOL_LARGE)
+    return sizeof(struct rowPoolLarge) + 1 + rowPoolCapacity(p);
+  return rowPoolClassSize[tag];
+}
+
+/**
+ * @brief Allocates n bytes of row data from the pool
+ * 
+ * Takes a recycled block of the right class if there is one, otherwise carves
+ * a new one out of the current slab.
+ * 
+ * @param pool the pool to allocate from
+ * @param n the number of bytes needed
+ */
+void *rowPoolAlloc(struct rowPool *pool, size_t n) {
+  if (n == 0) n = 1;
+
+  if (n > ROWPOOL_MAX_SMALL - 1) {
+    struct rowPoolLarge *l = malloc(sizeof(*l) + 1 + n);
+    if (l == NULL) die("malloc");
+    l->cap = n;
+    l->prev = NULL;
+    l->next = pool->large;
+    if (pool->large) pool->large->prev = l;
+    pool->large = l;
+    char *p = (char *)(l + 1);
+    *p = (char)ROWPOOL_LARGE;
+    return p + 1;
+  }
+
+  int cls = rowPoolClassOf(n);
+  char *block = pool->free[cls];
+  if (block) {
+    // Recycled blocks keep the next free list entry right after the tag
+    memcpy(&pool->free[cls], block + 1, sizeof(char *));
+  } else {
+    size_t size = rowPoolClassSize[cls];
+    if (pool->bump_left < size) {
+      // Whatever is left of the old slab is too small for this class and is
+      // simply abandoned until the pool is cleared
+      struct rowPoolSlab *slab = malloc(sizeof(*slab) + ROWPOOL_SLAB_SIZE);
+      if (slab == NULL) die("malloc");
+      slab->next = pool->slabs;
+      pool->slabs = slab;
+      pool->bump = (char *)(slab + 1);
+      pool->bump_left = ROWPOOL_SLAB_SIZE;
     }
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
+    block = pool->bump;
+    pool->bump += size;
+    pool->bump_left -= size;
+  }
+  block[0] = (char)cls;
+  return block + 1;
+}
+
+/**
+ * @brief Returns a block to the pool
+ * 
+ * @param pool the pool that allocated the block
+ * @param p the block to free, or NULL
+ */
+void rowPoolFree(struct rowPool *pool, void *p) {
+  if (p == NULL) return;
+  char *block = (char *)p - 1;
+  unsigned char tag = (unsigned char)block[0];
+
+  if (tag == ROWPOOL_LARGE) {
+    struct rowPoolLarge *l = (struct rowPoolLarge *)block - 1;
+    if (l->prev) l->prev->next = l->next;
+    else pool->large = l->next;
+    if (l->next) l->next->prev = l->prev;
+    free(l);
+    return;
+  }
+
+  memcpy(block + 1, &pool->free[tag], sizeof(char *));
+  pool->free[tag] = block;
+}
+
+/**
+ * @brief Resizes a block, keeping its contents
+ * 
+ * Growth that still fits the block's size class happens in place, which makes
+ * typing at the end of a line mostly free of copies.
+ * 
+ * @param pool the pool that allocated the block
+ * @param p the block to resize, or NULL to allocate a new one
+ * @param n the new size in bytes
+ */
+void *rowPoolRealloc(struct rowPool *pool, void *p, size_t n) {
+  if (p == NULL) return rowPoolAlloc(pool, n);
+
+  size_t cap = rowPoolCapacity(p);
+  if (n <= cap) return p;
+
+  char *block = (char *)p - 1;
+  if ((unsigned char)block[0] == ROWPOOL_LARGE) {
+    struct rowPoolLarge *l = (struct rowPoolLarge *)block - 1;
+    l = realloc(l, sizeof(*l) + 1 + n);
+    if (l == NULL) die("realloc");
+    l->cap = n;
+    if (l->prev) l->prev->next = l;
+    else pool->large = l;
+    if (l->next) l->next->prev = l;
+    return (char *)(l + 1) + 1;
+  }
+
+  void *new = rowPoolAlloc(pool, n);
+  memcpy(new, p, cap);
+  rowPoolFree(pool, p);
+  return new;
+}
+
+/**
+ * @brief Releases every block owned by the pool at once
+ * 
+ * @param pool the pool to clear
+ */
+void rowPoolClear(struct rowPool *pool) {
+  while (pool->slabs) {
+    struct rowPoolSlab *next = pool->slabs->next;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+  while (pool->large) {
+    struct rowPoolLarge *next = pool->large->next;
+    free(pool->large);
+    pool->large = next;
+  }
+  memset(pool, 0, sizeof(*pool));
+}
+
+/*** tracing ***/
+
+/** @struct traceEvent
+ *  @brief A span in the trace ring
+ * 
+ *  Every field is written and read with atomics. seq is cleared while the
+ * span is written and then set to its position in the ring plus one, so a
+ * reader can tell a complete span from one being overwritten.
+ * 
+ *  @var foreignstruct::seq
+ *  Member 'seq' the position of the span plus one, 0 while it is written
+ * 
+ *  @var foreignstruct::name
+ *  Member 'name' what the span measured, a string literal
+ * 
+ *  @var foreignstruct::cat
+ *  Member 'cat' the category of the span, a string literal
+ * 
+ *  @var foreignstruct::ts
+ *  Member 'ts' when the span began, in editorNowNs() time
+ * 
+ *  @var foreignstruct::dur
+ *  Member 'dur' how long the span took, in nanoseconds
+ * 
+ *  @var foreignstruct::tid
+ *  Member 'tid' the thread the span ran on
+ */
+struct traceEvent {
+  uint64_t seq;
+  const char *name;
+  const char *cat;
+  long long ts;
+  long long dur;
+  uint64_t tid;
+};
+
+/** @struct trace
+ *  @brief A lock-free ring of the most recent spans of every thread
+ * 
+ *  Threads claim a slot by bumping head, so recording a span never waits.
+ * Spans are stored whole, as Chrome trace "complete" events, so overwriting
+ * old ones never leaves a begin without its end.
+ * 
+ *  @var foreignstruct::filename
+ *  Member 'filename' the file the trace is written to
+ * 
+ *  @var foreignstruct::head
+ *  Member 'head' the number of spans ever recorded
+ * 
+ *  @var foreignstruct::origin
+ *  Member 'origin' when tracing started, time 0 of the trace
+ * 
+ *  @var foreignstruct::main
+ *  Member 'main' the id of the main thread
+ * 
+ *  @var foreignstruct::events
+ *  Member 'events' the ring of spans
+ */
+struct trace {
+  char *filename;
+  uint64_t head;
+  long long origin;
+  uint64_t main;
+  struct traceEvent events[KILO_TRACE_EVENTS];
+};
+
+/**
+ * @brief An id for the calling thread
+ */
+uint64_t editorTraceThread(void) {
+  return (uint64_t)(uintptr_t)pthread_self();
+}
+
+/**
+ * @brief Turns tracing on
+ * 
+ * @param filename the file editorTraceWrite() writes the trace to
+ */
+void editorTraceStart(char *filename) {
+  E.trace = calloc(1, sizeof(*E.trace));
+  if (E.trace == NULL) die("calloc");
+  E.trace->filename = filename;
+  E.trace->origin = editorNowNs();
+  E.trace->main = editorTraceThread();
+}
+
+/**
+ * @brief Returns the start of a span, or 0 when not tracing
+ */
+long long editorTraceBegin(void) {
+  return E.trace ? editorNowNs() : 0;
+}
+
+/**
+ * @brief Records a span that ran from start to end
+ * 
+ * Safe to call from any thread.
+ * 
+ * @param name what the span measured, a string literal
+ * @param cat the category of the span, a string literal
+ * @param start when the span began
+ * @param end when the span ended
+ */
+void editorTraceSpan(const char *name, const char *cat, long long start,
+                     long long end) {
+  struct trace *t = E.trace;
+  uint64_t i = __atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED);
+  struct traceEvent *ev = &t->events[i & (KILO_TRACE_EVENTS - 1)];
+
+  __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&ev->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->cat, cat, __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->ts, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->dur, end - start, __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->tid, editorTraceThread(), __ATOMIC_RELAXED);
+  __atomic_store_n(&ev->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Records a span that began at start, unless start is 0
+ * 
+ * @param name what the span measured, a string literal
+ * @param cat the category of the span, a string literal
+ * @param start the editorTraceBegin() of the span
+ */
+void editorTraceEnd(const char *name, const char *cat, long long start) {
+  if (start && E.trace) editorTraceSpan(name, cat, start, editorNowNs());
+}
+
+/**
+ * @brief Writes the spans in the ring as Chrome trace JSON
+ * 
+ * Spans still being written by other threads are left out. Returns the
+ * number of spans written, or -1 with errno set.
+ */
+int editorTraceWrite(void) {
+  struct trace *t = E.trace;
+  FILE *fp = fopen(t->filename, "w");
+  if (fp == NULL) return -1;
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"kilo\"}},\n"
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"tid\":%llu,\"args\":{\"name\":\"main\"}}",
+          (int)getpid(), (int)getpid(), (unsigned long long)t->main);
+
+  uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+  uint64_t i = head > KILO_TRACE_EVENTS ? head - KILO_TRACE_EVENTS : 0;
+  int n = 0;
+  for (; i < head; i++) {
+    struct traceEvent *ev = &t->events[i & (KILO_TRACE_EVENTS - 1)];
+    if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != i + 1) continue;
+    const char *name = __atomic_load_n(&ev->name, __ATOMIC_RELAXED);
+    const char *cat = __atomic_load_n(&ev->cat, __ATOMIC_RELAXED);
+    long long ts = __atomic_load_n(&ev->ts, __ATOMIC_RELAXED);
+    long long dur = __atomic_load_n(&ev->dur, __ATOMIC_RELAXED);
+    uint64_t tid = __atomic_load_n(&ev->tid, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != i + 1) continue;
+
+    fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"pid\":%d,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f}",
+            name, cat, (int)getpid(), (unsigned long long)tid,
+            (ts - t->origin) / 1e3, dur / 1e3);
+    n++;
+  }
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp) == EOF) return -1;
+  return n;
+}
+
+/**
+ * @brief Writes the trace when the user asks for it
+ */
+void editorTraceDump(void) {
+  if (E.trace == NULL) {
+    editorSetStatusMessage("Tracing is off, start kilo with --trace FILE");
+    return;
+  }
+  int n = editorTraceWrite();
+  if (n == -1)
+    editorSetStatusMessage("Can't write trace: %s", strerror(errno));
+  else
+    editorSetStatusMessage("Wrote %d spans to %s", n, E.trace->filename);
+}
+
+/**
+ * @brief Writes the trace on exit
+ * 
+ * Registered with atexit(), so the spans leading up to the exit are kept.
+ */
+void editorTraceExit(void) {
+  if (E.trace) editorTraceWrite();
+}
+
+/*** latency ***/
+
+/**
+ * @brief Maps a time to its histogram bucket
+ * 
+ * @param ns the time in nanoseconds
+ */
+int latencyBucket(long long ns) {
+  if (ns < KILO_LATENCY_SUB) return ns < 0 ? 0 : (int)ns;
+  int shift = 63 - __builtin_clzll(ns) - KILO_LATENCY_SUB_BITS;
+  return (shift + 1) * KILO_LATENCY_SUB +
+         (int)(ns >> shift) - KILO_LATENCY_SUB;
+}
+
+/**
+ * @brief The longest time that maps to a histogram bucket
+ * 
+ * @param b the bucket
+ */
+long long latencyBucketMax(int b) {
+  int group = b / KILO_LATENCY_SUB, sub = b % KILO_LATENCY_SUB;
+  if (group == 0) return sub;
+  return ((long long)(KILO_LATENCY_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+/**
+ * @brief Records the time a phase took
+ * 
+ * @param phase the latencyPhase
+ * @param ns the time in nanoseconds
+ */
+void editorLatencyRecord(int phase, long long ns) {
+  struct latencyHist *h = &E.latency.hist[phase];
+  h->buckets[latencyBucket(ns)]++;
+  h->count++;
+  if (ns > h->max) h->max = ns;
+}
+
+/**
+ * @brief Records a phase that began at start, unless start is 0
+ * 
+ * The phase is also added to the trace when tracing.
+ * 
+ * @param phase the latencyPhase
+ * @param start the editorNowNs() the phase began at, 0 if it is not timed
+ */
+void editorLatencyEnd(int phase, long long start) {
+  static const char *names[LATENCY_PHASES] = {
+    "edit", "highlight", "render", "flush"
+  };
+  static const char *cats[LATENCY_PHASES] = { "edit", "edit", "output",
+                                              "output" };
+  if (start == 0) return;
+  long long now = editorNowNs();
+  editorLatencyRecord(phase, now - start);
+  if (E.trace) editorTraceSpan(names[phase], cats[phase], start, now);
+}
+
+/**
+ * @brief Returns the time below which a fraction of the recorded times fall
+ * 
+ * The answer is the top of the bucket the percentile lands in, never more
+ * than the longest time recorded.
+ * 
+ * @param h the histogram
+ * @param p the fraction, between 0 and 1
+ */
+long long latencyPercentile(struct latencyHist *h, double p) {
+  long long want = (long long)(p * h->count + 0.5), seen = 0;
+  if (want < 1) want = 1;
+  for (int b = 0; b < KILO_LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= want) {
+      long long ns = latencyBucketMax(b);
+      return ns < h->max ? ns : h->max;
+    }
+  }
+  return h->max;
+}
+
+/**
+ * @brief Starts timing the key that was just read
+ * 
+ * The key phase runs until the screen is next redrawn, so keys that open a
+ * prompt only count until the prompt is drawn, and each key typed into the
+ * prompt counts on its own.
+ */
+void editorLatencyKeyStart(void) {
+  E.latency.keystart = editorNowNs();
+}
+
+/**
+ * @brief Stops timing the key being handled, if there is one
+ */
+void editorLatencyKeyEnd(void) {
+  editorLatencyEnd(LATENCY_KEY, E.latency.keystart);
+  E.latency.keystart = 0;
+}
+
+/**
+ * @brief Formats a time in microseconds for the status bar
+ */
+void latencyFormat(char *buf, size_t size, long long ns) {
+  double us = ns / 1e3;
+  snprintf(buf, size, us < 10 ? "%.1f" : "%.0f", us);
+}
+
+/**
+ * @brief Writes p50/p99/max of every phase into the status bar text
+ * 
+ * Returns the length of the text, like snprintf().
+ * 
+ * @param buf the status bar text
+ * @param size the size of buf
+ */
+int editorLatencyStatus(char *buf, size_t size) {
+  static const char *names[LATENCY_PHASES] = { "key", "hl", "draw", "flush" };
+  int len = 0;
+  buf[0] = '\0';
+  for (int i = 0; i < LATENCY_PHASES && (size_t)len < size; i++) {
+    struct latencyHist *h = &E.latency.hist[i];
+    char p50[16], p99[16], max[16];
+    latencyFormat(p50, sizeof(p50), latencyPercentile(h, 0.5));
+    latencyFormat(p99, sizeof(p99), latencyPercentile(h, 0.99));
+    latencyFormat(max, sizeof(max), h->max);
+    len += snprintf(buf + len, size - len, "%s %s/%s/%s ", names[i],
+                    p50, p99, max);
+  }
+  if ((size_t)len < size) len += snprintf(buf + len, size - len, "us");
+  return (size_t)len < size ? len : (int)size - 1;
+}
+
+/**
+ * @brief Turns the latencies in the status bar on or off
+ */
+void editorLatencyToggle(void) {
+  E.latency.show = !E.latency.show;
+  E.latency.shown = 1;
+  if (E.latency.show)
+    editorSetStatusMessage("Latency p50/p99/max per phase (Ctrl-T to hide)");
+}
+
+/**
+ * @brief Prints the latency percentiles of every phase to stderr
+ * 
+ * Registered with atexit() before raw mode is entered, so it runs after the
+ * terminal is restored. Only prints after a headless run or once the
+ * latencies were shown.
+ */
+void editorLatencyReport(void) {
+  static const char *names[LATENCY_PHASES] = {
+    "key", "syntax", "draw", "flush"
+  };
+  if (!E.latency.shown && E.headless == NULL) return;
+  fprintf(stderr, "%-8s %10s %10s %10s %10s %10s %10s\n", "phase", "count",
+          "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  for (int i = 0; i < LATENCY_PHASES; i++) {
+    struct latencyHist *h = &E.latency.hist[i];
+    if (h->count == 0) continue;
+    fprintf(stderr, "%-8s %10lld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            names[i], h->count, latencyPercentile(h, 0.5) / 1e3,
+            latencyPercentile(h, 0.9) / 1e3, latencyPercentile(h, 0.99) / 1e3,
+            latencyPercentile(h, 0.999) / 1e3, h->max / 1e3);
+  }
+}
+
+/*** syntax highlighting ***/
+
+/**
+ * @brief Identifies seperator charcters
+ * 
+ * strchr() returns a pointer to the first matching char of a string.
+ * 
+ * @param c a char to identify
+ */
+int is_separator(int c) {
+  return isspace(c) || c == "\0" || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+
+/**
+ * @brief Goes through the characters of an erow and highlights them all
+ * 
+ * @param row the erow we want to highlight
+ */
+void editorUpdateSyntax(erow *row) {
+  // Only rows highlighted on behalf of a key are timed, not a whole file
+  // being loaded
+  long long start = E.latency.keystart ? editorNowNs() : 0;
+  row->hl = rowPoolRealloc(&E.pool, row->hl, row->rsize);
+  memset(row->hl, HL_NORMAL, row->rsize);
+  if (E.syntax == NULL) {
+    editorLatencyEnd(LATENCY_SYNTAX, start);
+    return;
+  }
+  char **keywords = E.syntax->keywords;
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+  int prev_sep = 1;
+  int in_string = 0;
+  int in_comment = (row->idx > 0 &&
+                    (E.rowflags[row->idx - 1] & ROW_OPEN_COMMENT));
+  int i = 0;
+  while (i < row->rsize) {
+    char c = row->render[i];
+    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    if (scs_len && !in_string && !in_comment) {
+      if (!strncmp(&row->render[i], scs, scs_len)) {
+        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+        break;
+      }
+    }
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        row->hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&row->render[i], mce, mce_len)) {
+          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        } else {
+          i++;
+          continue;
+        }
+      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        row->hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < row->rsize) {
+          row->hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == in_string) in_string = 0;
+        i++;
+        prev_sep = 1;
         continue;
       } else {
         if (c == '"' || c == '\'') {
@@ -485,8 +1718,11 @@ void editorUpdateSyntax(erow *row) {
     prev_sep = is_separator(c);
     i++;
   }
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
+  unsigned char *flags = &E.rowflags[row->idx];
+  int changed = (((*flags & ROW_OPEN_COMMENT) != 0) != in_comment);
+  if (in_comment) *flags |= ROW_OPEN_COMMENT;
+  else *flags &= ~ROW_OPEN_COMMENT;
+  editorLatencyEnd(LATENCY_SYNTAX, start);
   if (changed && row->idx + 1 < E.numrows)
     editorUpdateSyntax(&E.row[row->idx + 1]);
 }
@@ -545,78 +1781,836 @@ void editorSelectSyntaxHighlight() {
 
 
 
-/*** row operations ***/
+/*** snapshots ***/
 
 /**
- * @brief Calculates the correct row length by counting tabs correctly
+ * @brief Hands a replaced chars array over to the retired list
  * 
- * @param *row a reference to the row that we are counting
- * @param cx the length of the row to fix 
+ * The array cannot go back to the pool while a snapshot may still be
+ * reading it.
+ * 
+ * @param chars the array to retire
  */
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    rx++;
+void editorRetire(char *chars) {
+  if (E.nretired == E.retiredcap) {
+    E.retiredcap = E.retiredcap ? E.retiredcap * 2 : 64;
+    E.retired = realloc(E.retired, sizeof(char *) * E.retiredcap);
+    if (E.retired == NULL) die("realloc");
   }
-  return rx;
+  E.retired[E.nretired++] = chars;
 }
 
-
 /**
- * @brief Converts a render index into a index in the chars array
+ * @brief Checks whether a live snapshot may be reading a row's chars
  * 
- * @param *row a reference to the row that we are counting
- * @param rx the render index
+ * @param row the row to check
  */
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
-    if (cur_rx > rx) return cx;
-  }
-  return cx;
+int editorRowIsShared(erow *row) {
+  return row->gen <= E.snapgen;
 }
 
-
 /**
- * @brief Updates the render array whenever the text of the row changes.
+ * @brief Gives a row a private copy of its chars before it is modified
  * 
- * The main function of this is to render tabs as multiple space characters
- * and make sure the sizes are being tracked properly. Memory 
+ * Rows are shared with snapshots copy-on-write: the snapshot keeps the old
+ * array, which is retired, and the row continues with a fresh copy. render
+ * may still alias the old array until the caller runs editorUpdateRow().
  * 
- * @param *row a reference to the raw row data
+ * @param row the row about to be modified
  */
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+void editorRowUnshare(erow *row) {
+  if (!editorRowIsShared(row)) return;
+  char *chars = rowPoolAlloc(&E.pool, row->size + 1);
+  memcpy(chars, row->chars, row->size + 1);
+  editorRetire(row->chars);
+  row->chars = chars;
+  row->gen = E.gen;
+}
 
-  // Allocate enough memory to fit the tabs + the newline char at the end
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+/**
+ * @brief Allocates an empty row tree node owned by its caller
+ * 
+ * @param leaf whether the node is a leaf
+ */
+struct rowNode *rowNodeNew(int leaf) {
+  struct rowNode *node = malloc(sizeof(*node));
+  if (node == NULL) die("malloc");
+  node->refs = 1;
+  node->leaf = leaf;
+  node->n = 0;
+  node->count = 0;
+  return node;
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
+/**
+ * @brief Drops a reference to a row tree node, freeing it with the last one
+ * 
+ * @param node the node
+ */
+void rowNodeRelease(struct rowNode *node) {
+  if (--node->refs > 0) return;
+  if (!node->leaf)
+    for (int k = 0; k < node->n; k++) rowNodeRelease(node->ptr[k]);
+  free(node);
+}
+
+/**
+ * @brief Makes the node in a slot safe to modify
+ * 
+ * A node that a snapshot shares is copied first, the copy taking a reference
+ * to each child, and the slot is pointed at the copy. This path copying is
+ * what keeps every snapshot unchanged while the live tree is edited.
+ * 
+ * @param slot the parent's pointer to the node
+ */
+struct rowNode *rowNodeMutable(struct rowNode **slot) {
+  struct rowNode *node = *slot;
+  if (node->refs == 1) return node;
+
+  struct rowNode *copy = malloc(sizeof(*copy));
+  if (copy == NULL) die("malloc");
+  memcpy(copy, node, sizeof(*copy));
+  copy->refs = 1;
+  if (!copy->leaf)
+    for (int k = 0; k < copy->n; k++) ((struct rowNode *)copy->ptr[k])->refs++;
+  node->refs--;
+  *slot = copy;
+  return copy;
+}
+
+/**
+ * @brief Finds the child of an inner node that holds a row
+ * 
+ * An index one past the end lands in the last child, for appending.
+ * 
+ * @param node the inner node
+ * @param i the row index within node, set to the index within the child
+ */
+int rowNodeFind(struct rowNode *node, int *i) {
+  int k = 0;
+  while (k < node->n - 1 && *i >= node->num[k]) {
+    *i -= node->num[k];
+    k++;
+  }
+  return k;
+}
+
+/**
+ * @brief Positions an iterator on a row of a snapshot
+ * 
+ * @param it the iterator
+ * @param snap the snapshot
+ * @param first the index of the first row to visit
+ */
+void rowIterInit(struct rowIter *it, struct rowNode *snap, int first) {
+  int d = 0;
+  it->node[0] = snap;
+  while (!it->node[d]->leaf) {
+    it->pos[d] = rowNodeFind(it->node[d], &first);
+    it->node[d + 1] = it->node[d]->ptr[it->pos[d]];
+    d++;
+  }
+  it->pos[d] = first;
+  it->depth = d;
+}
+
+/**
+ * @brief Returns the next row of a snapshot, or 0 past the last one
+ * 
+ * @param it the iterator
+ * @param chars set to the row text
+ * @param size set to the row length
+ */
+int rowIterNext(struct rowIter *it, char **chars, int *size) {
+  int d = it->depth;
+  if (it->pos[d] >= it->node[d]->n) {
+    // Climb to the nearest ancestor with another child, then take the
+    // leftmost path down from it
+    do {
+      if (d == 0) return 0;
+      d--;
+      it->pos[d]++;
+    } while (it->pos[d] >= it->node[d]->n);
+    while (d < it->depth) {
+      it->node[d + 1] = it->node[d]->ptr[it->pos[d]];
+      d++;
+      it->pos[d] = 0;
+    }
+  }
+  *chars = it->node[d]->ptr[it->pos[d]];
+  *size = it->node[d]->num[it->pos[d]];
+  it->pos[d]++;
+  return 1;
+}
+
+/**
+ * @brief Builds a balanced row tree in one pass
+ * 
+ * Nodes are filled to three quarters so the first edits do not split them
+ * right away.
+ * 
+ * @param from the tree to copy the rows of, NULL to take them from E.row
+ */
+struct rowNode *rowTreeBuild(struct rowNode *from) {
+  int fill = ROWTREE_FANOUT * 3 / 4;
+  int numrows = from ? from->count : E.numrows;
+  int n = (numrows + fill - 1) / fill;
+  if (n == 0) return rowNodeNew(1);
+
+  struct rowNode **level = malloc(sizeof(*level) * n);
+  if (level == NULL) die("malloc");
+  struct rowIter it;
+  if (from) rowIterInit(&it, from, 0);
+  for (int j = 0; j < n; j++) {
+    struct rowNode *leaf = rowNodeNew(1);
+    for (int r = j * fill; r < numrows && leaf->n < fill; r++) {
+      if (from) {
+        rowIterNext(&it, (char **)&leaf->ptr[leaf->n], &leaf->num[leaf->n]);
+      } else {
+        leaf->ptr[leaf->n] = E.row[r].chars;
+        leaf->num[leaf->n] = E.row[r].size;
+      }
+      leaf->n++;
+    }
+    leaf->count = leaf->n;
+    level[j] = leaf;
+  }
+
+  while (n > 1) {
+    int up = (n + fill - 1) / fill;
+    for (int j = 0; j < up; j++) {
+      struct rowNode *inner = rowNodeNew(0);
+      for (int c = j * fill; c < n && inner->n < fill; c++) {
+        inner->ptr[inner->n] = level[c];
+        inner->num[inner->n] = level[c]->count;
+        inner->count += level[c]->count;
+        inner->n++;
+      }
+      level[j] = inner;
+    }
+    n = up;
+  }
+
+  struct rowNode *root = level[0];
+  free(level);
+  return root;
+}
+
+
+/**
+ * @brief Inserts a row below a slot
+ * 
+ * Full nodes split in half on the way back up. Returns the new right half
+ * when the node in the slot split, NULL otherwise.
+ * 
+ * @param slot the parent's pointer to the node
+ * @param i the index to insert at within the node
+ * @param chars the row text
+ * @param size the row length
+ */
+struct rowNode *rowNodeInsert(struct rowNode **slot, int i, char *chars,
+                              int size) {
+  struct rowNode *node = rowNodeMutable(slot);
+  node->count++;
+  if (node->leaf) {
+    memmove(&node->ptr[i + 1], &node->ptr[i], sizeof(void *) * (node->n - i));
+    memmove(&node->num[i + 1], &node->num[i], sizeof(int) * (node->n - i));
+    node->ptr[i] = chars;
+    node->num[i] = size;
+    node->n++;
+  } else {
+    int k = rowNodeFind(node, &i);
+    struct rowNode *split = rowNodeInsert((struct rowNode **)&node->ptr[k], i,
+                                          chars, size);
+    node->num[k] = ((struct rowNode *)node->ptr[k])->count;
+    if (split) {
+      memmove(&node->ptr[k + 2], &node->ptr[k + 1],
+              sizeof(void *) * (node->n - k - 1));
+      memmove(&node->num[k + 2], &node->num[k + 1],
+              sizeof(int) * (node->n - k - 1));
+      node->ptr[k + 1] = split;
+      node->num[k + 1] = split->count;
+      node->n++;
+    }
+  }
+  if (node->n < ROWTREE_FANOUT) return NULL;
+
+  struct rowNode *right = rowNodeNew(node->leaf);
+  int half = node->n / 2;
+  right->n = node->n - half;
+  memcpy(right->ptr, &node->ptr[half], sizeof(void *) * right->n);
+  memcpy(right->num, &node->num[half], sizeof(int) * right->n);
+  node->n = half;
+  if (node->leaf) {
+    right->count = right->n;
+  } else {
+    right->count = 0;
+    for (int k = 0; k < right->n; k++) right->count += right->num[k];
+  }
+  node->count -= right->count;
+  return right;
+}
+
+/**
+ * @brief Removes a row below a slot
+ * 
+ * Nodes left empty are freed; nodes are otherwise allowed to run underfull,
+ * which keeps the tree no deeper than it was at its largest.
+ * 
+ * @param slot the parent's pointer to the node
+ * @param i the index to remove within the node
+ */
+void rowNodeDelete(struct rowNode **slot, int i) {
+  struct rowNode *node = rowNodeMutable(slot);
+  node->count--;
+  if (node->leaf) {
+    node->n--;
+    memmove(&node->ptr[i], &node->ptr[i + 1], sizeof(void *) * (node->n - i));
+    memmove(&node->num[i], &node->num[i + 1], sizeof(int) * (node->n - i));
+    return;
+  }
+
+  int k = rowNodeFind(node, &i);
+  rowNodeDelete((struct rowNode **)&node->ptr[k], i);
+  struct rowNode *child = node->ptr[k];
+  node->num[k] = child->count;
+  if (child->n == 0) {
+    rowNodeRelease(child);
+    node->n--;
+    memmove(&node->ptr[k], &node->ptr[k + 1], sizeof(void *) * (node->n - k));
+    memmove(&node->num[k], &node->num[k + 1], sizeof(int) * (node->n - k));
+  }
+}
+
+/**
+ * @brief Mirrors a new row into the row tree
+ * 
+ * @param at the index of the row
+ * @param chars the row text
+ * @param size the row length
+ */
+void rowTreeInsert(int at, char *chars, int size) {
+  struct rowNode *split = rowNodeInsert(&E.rowtree, at, chars, size);
+  if (split == NULL) return;
+
+  struct rowNode *root = rowNodeNew(0);
+  root->ptr[0] = E.rowtree;
+  root->num[0] = E.rowtree->count;
+  root->ptr[1] = split;
+  root->num[1] = split->count;
+  root->n = 2;
+  root->count = root->num[0] + root->num[1];
+  E.rowtree = root;
+
+  // Deletions leave nodes underfull, so in theory the tree can outgrow the
+  // iterators; start it over balanced before that happens
+  int depth = 0;
+  for (struct rowNode *node = root; !node->leaf; node = node->ptr[0]) depth++;
+  if (depth >= ROWTREE_MAX_DEPTH - 1) {
+    E.rowtree = rowTreeBuild(root);
+    rowNodeRelease(root);
+  }
+}
+
+/**
+ * @brief Mirrors the deletion of a row into the row tree
+ * 
+ * @param at the index of the row
+ */
+void rowTreeDelete(int at) {
+  rowNodeDelete(&E.rowtree, at);
+
+  // Drop roots that are left with a single child
+  while (!E.rowtree->leaf && E.rowtree->n <= 1) {
+    struct rowNode *root = E.rowtree;
+    if (root->n == 0) {
+      E.rowtree = rowNodeNew(1);
+    } else {
+      E.rowtree = root->ptr[0];
+      E.rowtree->refs++;
+    }
+    rowNodeRelease(root);
+  }
+}
+
+/**
+ * @brief Mirrors a change to a row's text into the row tree
+ * 
+ * @param at the index of the row
+ * @param chars the row text
+ * @param size the row length
+ */
+void rowTreeSet(int at, char *chars, int size) {
+  struct rowNode *node = rowNodeMutable(&E.rowtree);
+  while (!node->leaf) {
+    int k = rowNodeFind(node, &at);
+    node = rowNodeMutable((struct rowNode **)&node->ptr[k]);
+  }
+  node->ptr[at] = chars;
+  node->num[at] = size;
+}
+
+/**
+ * @brief Takes a read-only snapshot of the buffer's text
+ * 
+ * Takes another reference to the root of the row tree, which is O(1); the
+ * tree itself is only built by the first snapshot. Nodes are copied lazily
+ * by rowNodeMutable() and row text by editorRowUnshare() when they are
+ * edited afterwards, so all snapshots share whatever they have in common
+ * with each other and with the live buffer. Until editorReleaseSnapshot() is
+ * called, other threads may read the snapshot through a rowIter.
+ */
+struct rowNode *editorTakeSnapshot(void) {
+  if (E.rowtree == NULL) E.rowtree = rowTreeBuild(NULL);
+  E.rowtree->refs++;
+
+  // Row text allocated from now on belongs to the next generation
+  E.snapgen = E.gen++;
+  E.snapshots++;
+  return E.rowtree;
+}
+
+/**
+ * @brief Releases a snapshot taken with editorTakeSnapshot()
+ * 
+ * Once no snapshot is left, the chars arrays retired in the meantime go
+ * back to the pool.
+ * 
+ * @param snap the snapshot to release
+ */
+void editorReleaseSnapshot(struct rowNode *snap) {
+  rowNodeRelease(snap);
+  if (--E.snapshots > 0) return;
+
+  for (int j = 0; j < E.nretired; j++) rowPoolFree(&E.pool, E.retired[j]);
+  E.nretired = 0;
+  E.snapgen = -1;
+}
+
+/*** trigram index ***/
+
+/** @struct trigramIndex
+ *  @brief The trigram signatures of a file's rows, built in the background
+ * 
+ *  Every row gets a small Bloom filter of the trigrams it holds, folded to
+ * lowercase, kept in E.rowsig. A row can only contain a query if its
+ * signature has every bit of the query's, so most rows are ruled out
+ * without reading their text. Rows changed since the build started sign
+ * themselves in editorUpdateRow(); the build fills in the rest.
+ * 
+ *  @var foreignstruct::rows
+ *  Member 'rows' the snapshot being signed
+ * 
+ *  @var foreignstruct::numrows
+ *  Member 'numrows' the number of rows in the snapshot
+ * 
+ *  @var foreignstruct::sigs
+ *  Member 'sigs' the signatures of the snapshot's rows, owned by the thread
+ * until done is set
+ * 
+ *  @var foreignstruct::moved
+ *  Member 'moved' set when rows were inserted or deleted before the end of
+ * the snapshot, which makes its row numbers useless
+ * 
+ *  @var foreignstruct::stop
+ *  Member 'stop' set under lock to make the thread give up
+ * 
+ *  @var foreignstruct::done
+ *  Member 'done' set by the thread under lock once it has finished
+ * 
+ *  @var foreignstruct::ready
+ *  Member 'ready' set once every row has a signature
+ */
+struct trigramIndex {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct rowNode *rows;
+  int numrows;
+  uint64_t *sigs;
+  int moved;
+  int stop;
+  int done;
+  int ready;
+};
+
+/**
+ * @brief Computes the trigram signature of some text
+ * 
+ * @param s the text
+ * @param len the length of the text
+ * @param sig the KILO_TRIGRAM_WORDS words to fill
+ */
+void trigramSign(const char *s, int len, uint64_t *sig) {
+  const unsigned char *p = (const unsigned char *)s;
+  memset(sig, 0, sizeof(uint64_t) * KILO_TRIGRAM_WORDS);
+  uint32_t v = 0;
+  for (int i = 0; i < len; i++) {
+    v = ((v << 8) | tolower(p[i])) & 0xffffff;
+    if (i < 2) continue;
+    uint32_t bit = (v * 2654435761u) >> 24;
+    bit %= KILO_TRIGRAM_BITS;
+    sig[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+}
+
+/**
+ * @brief Brings a row's signature up to date
+ * 
+ * Called by editorUpdateRow() whenever the index exists.
+ * 
+ * @param row the row
+ */
+void editorTrigramSignRow(erow *row) {
+  trigramSign(row->chars, row->size,
+              &E.rowsig[(size_t)row->idx * KILO_TRIGRAM_WORDS]);
+  E.rowflags[row->idx] |= ROW_SIGNED;
+}
+
+/**
+ * @brief Entry point of the thread building the trigram index
+ * 
+ * @param arg the trigramIndex to build
+ */
+void *editorTrigramThread(void *arg) {
+  struct trigramIndex *ix = arg;
+  struct rowIter it;
+  char *chars;
+  int size;
+  rowIterInit(&it, ix->rows, 0);
+  for (int i = 0; rowIterNext(&it, &chars, &size); i++) {
+    trigramSign(chars, size, &ix->sigs[(size_t)i * KILO_TRIGRAM_WORDS]);
+
+    if (i % 65536 == 0) {
+      pthread_mutex_lock(&ix->lock);
+      int stop = ix->stop;
+      pthread_mutex_unlock(&ix->lock);
+      if (stop) break;
+    }
+  }
+
+  pthread_mutex_lock(&ix->lock);
+  ix->done = 1;
+  pthread_mutex_unlock(&ix->lock);
+  return NULL;
+}
+
+/**
+ * @brief Starts building a trigram index of the buffer in the background
+ * 
+ * Files with fewer than KILO_TRIGRAM_MIN_ROWS rows are searched quickly
+ * enough without one.
+ */
+void editorTrigramStart(void) {
+  if (KILO_TRIGRAM_MIN_ROWS == 0 || E.numrows < KILO_TRIGRAM_MIN_ROWS) return;
+
+  struct trigramIndex *ix = calloc(1, sizeof(*ix));
+  if (ix == NULL) die("calloc");
+  ix->numrows = E.numrows;
+  ix->sigs = malloc(sizeof(uint64_t) * KILO_TRIGRAM_WORDS * ix->numrows);
+  E.rowsig = malloc(sizeof(uint64_t) * KILO_TRIGRAM_WORDS * E.rowcap);
+  if (ix->sigs == NULL || E.rowsig == NULL) die("malloc");
+  for (int i = 0; i < E.numrows; i++) E.rowflags[i] &= ~ROW_SIGNED;
+  ix->rows = editorTakeSnapshot();
+  pthread_mutex_init(&ix->lock, NULL);
+
+  // Leave signals such as SIGWINCH to the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&ix->thread, NULL, editorTrigramThread, ix);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  E.trigram = ix;
+  if (err != 0) {
+    // Searching works the same without the index, only slower
+    editorReleaseSnapshot(ix->rows);
+    ix->rows = NULL;
+    editorTrigramStop();
+  }
+}
+
+/**
+ * @brief Collects a finished build of the trigram index
+ * 
+ * The snapshot's signatures are copied to the rows that have not signed
+ * themselves since. If rows moved in the meantime the build starts over
+ * from the current buffer.
+ */
+void editorTrigramFinish(void) {
+  struct trigramIndex *ix = E.trigram;
+  pthread_join(ix->thread, NULL);
+  editorReleaseSnapshot(ix->rows);
+  ix->rows = NULL;
+
+  if (ix->moved) {
+    editorTrigramStop();
+    editorTrigramStart();
+    return;
+  }
+  // Rows deleted from the end of the snapshot moved nothing, but are gone
+  for (int i = 0; i < ix->numrows && i < E.numrows; i++) {
+    if (E.rowflags[i] & ROW_SIGNED) continue;
+    memcpy(&E.rowsig[(size_t)i * KILO_TRIGRAM_WORDS],
+           &ix->sigs[(size_t)i * KILO_TRIGRAM_WORDS],
+           sizeof(uint64_t) * KILO_TRIGRAM_WORDS);
+    E.rowflags[i] |= ROW_SIGNED;
+  }
+  free(ix->sigs);
+  ix->sigs = NULL;
+  ix->ready = 1;
+}
+
+/**
+ * @brief Collects the trigram index as soon as its build completes
+ * 
+ * Polled from editorPollEvents() while the editor is idle.
+ */
+void editorTrigramPoll(void) {
+  struct trigramIndex *ix = E.trigram;
+  if (ix == NULL || ix->ready) return;
+
+  pthread_mutex_lock(&ix->lock);
+  int done = ix->done;
+  pthread_mutex_unlock(&ix->lock);
+  if (done) editorTrigramFinish();
+}
+
+/**
+ * @brief Throws the trigram index away, stopping its build if needed
+ */
+void editorTrigramStop(void) {
+  struct trigramIndex *ix = E.trigram;
+  if (ix == NULL) return;
+  if (ix->rows) {
+    pthread_mutex_lock(&ix->lock);
+    ix->stop = 1;
+    pthread_mutex_unlock(&ix->lock);
+    pthread_join(ix->thread, NULL);
+    editorReleaseSnapshot(ix->rows);
+  }
+  pthread_mutex_destroy(&ix->lock);
+  free(ix->sigs);
+  free(ix);
+  free(E.rowsig);
+  E.rowsig = NULL;
+  E.trigram = NULL;
+}
+
+/**
+ * @brief Returns the rows that may contain a query, NULL if the index
+ * cannot tell
+ * 
+ * Only queries of at least three bytes have a trigram to look for.
+ * 
+ * @param query the query
+ * @param n set to the number of rows returned
+ */
+int *editorTrigramCandidates(const char *query, int *n) {
+  struct trigramIndex *ix = E.trigram;
+  int len = strlen(query);
+  if (ix == NULL || !ix->ready || len < 3) return NULL;
+
+  uint64_t q[KILO_TRIGRAM_WORDS];
+  trigramSign(query, len, q);
+  int *rows = malloc(sizeof(int) * (E.numrows ? E.numrows : 1));
+  if (rows == NULL) die("malloc");
+  *n = 0;
+  const uint64_t *sig = E.rowsig;
+  for (int i = 0; i < E.numrows; i++, sig += KILO_TRIGRAM_WORDS) {
+    uint64_t miss = 0;
+    for (int w = 0; w < KILO_TRIGRAM_WORDS; w++) miss |= q[w] & ~sig[w];
+    if (!miss) rows[(*n)++] = i;
+  }
+  return rows;
+}
+
+/*** row operations ***/
+
+/**
+ * @brief Finds the last tab in a row that satisfies a bound
+ * 
+ * Binary searches row->tabs for the last entry whose cx (or rx, when by_rx is
+ * set) is below limit.
+ * 
+ * @param row the row whose tab index is searched
+ * @param limit the exclusive upper bound
+ * @param by_rx compare against the render column instead of the chars index
+ */
+int editorRowLastTabBefore(erow *row, int limit, int by_rx) {
+  int lo = 0, hi = row->ntabs;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int key = by_rx ? row->tabs[mid].rx : row->tabs[mid].cx;
+    if (key < limit) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+/**
+ * @brief Calculates the correct row length by counting tabs correctly
+ * 
+ * Uses the row's tab index instead of scanning the row from column 0.
+ * 
+ * @param *row a reference to the row that we are counting
+ * @param cx the length of the row to fix 
+ */
+int editorRowCxToRx(erow *row, int cx) {
+  int t = editorRowLastTabBefore(row, cx, 0);
+  if (t < 0) return cx;
+  return row->tabs[t].rx + (cx - row->tabs[t].cx - 1);
+}
+
+
+/**
+ * @brief Converts a render index into a index in the chars array
+ * 
+ * Uses the row's tab index instead of scanning the row from column 0.
+ * 
+ * @param *row a reference to the row that we are counting
+ * @param rx the render index
+ */
+int editorRowRxToCx(erow *row, int rx) {
+  // The last tab whose padding ends at or before rx starts a run where
+  // chars and render line up one to one
+  int t = editorRowLastTabBefore(row, rx + 1, 1);
+  int cx = (t < 0) ? rx : row->tabs[t].cx + 1 + (rx - row->tabs[t].rx);
+
+  // rx may fall inside the padding of the following tab
+  if (t + 1 < row->ntabs && cx >= row->tabs[t + 1].cx) return row->tabs[t + 1].cx;
+  if (cx > row->size) return row->size;
+  return cx;
+}
+
+
+/**
+ * @brief Releases the render array of a row
+ * 
+ * render is only a separate allocation when the row contains tabs, otherwise
+ * it aliases chars and must not be freed on its own. The tab index lives in
+ * the tail of the render allocation and goes with it.
+ * 
+ * @param *row a reference to the row
+ */
+void editorRowFreeRender(erow *row) {
+  if (row->ntabs) rowPoolFree(&E.pool, row->render);
+  row->render = NULL;
+  row->tabs = NULL;
+}
+
+/**
+ * @brief Updates the render array whenever the text of the row changes.
+ * 
+ * The main function of this is to render tabs as multiple space characters
+ * and make sure the sizes are being tracked properly. Rows without tabs render
+ * exactly as they are stored (control characters are only substituted while
+ * drawing), so their render array simply points at chars.
+ * 
+ * @param *row a reference to the raw row data
+ */
+void editorUpdateRow(erow *row) {
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++)
+    if (row->chars[j] == '\t') tabs++;
+
+  // chars may have been reallocated since the last update, so the old render
+  // pointer is only trusted for rows that own a separate copy
+  editorRowFreeRender(row);
+  row->ntabs = 0;
+
+  E.rowsize[row->idx] = row->size;
+  E.rowdiskoff[row->idx] = -1;
+  if (E.rowtree) rowTreeSet(row->idx, row->chars, row->size);
+  if (E.rowsig) editorTrigramSignRow(row);
+
+  if (tabs == 0) {
+    row->render = row->chars;
+    row->rsize = row->size;
+    E.rowrsize[row->idx] = row->rsize;
+    editorUpdateSyntax(row);
+    return;
+  }
+
+  // Allocate enough memory to fit the tabs + the newline char at the end,
+  // followed by the tab index. The pool only guarantees byte alignment, so
+  // leave room to align the index by hand
+  size_t rlen = row->size + tabs*(KILO_TAB_STOP - 1) + 1;
+  row->render = rowPoolAlloc(&E.pool,
+                             rlen + sizeof(rowTab) * (tabs + 1));
+
+  // The tab index is rebuilt in the same pass that expands the tabs
+  uintptr_t tabaddr = (uintptr_t)(row->render + rlen);
+  tabaddr = (tabaddr + sizeof(int) - 1) & ~(uintptr_t)(sizeof(int) - 1);
+  row->tabs = (rowTab *)tabaddr;
+
+  int idx = 0;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[idx++] = ' ';
       while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+      row->tabs[row->ntabs].cx = j;
+      row->tabs[row->ntabs].rx = idx;
+      row->ntabs++;
     } else {
       row->render[idx++] = row->chars[j];
     }
   }
   row->render[idx] = '\0';
   row->rsize = idx;
+  E.rowrsize[row->idx] = row->rsize;
 
   editorUpdateSyntax(row);
 }
 
+/**
+ * @brief Makes sure E.row and its parallel metadata arrays can hold n rows
+ * 
+ * The arrays grow geometrically so loading a file does not reallocate them
+ * once per line.
+ * 
+ * @param n the number of rows needed
+ */
+void editorRowsReserve(int n) {
+  if (n <= E.rowcap) return;
+  int cap = E.rowcap ? E.rowcap : 64;
+  while (cap < n) cap *= 2;
+
+  E.row = realloc(E.row, sizeof(erow) * cap);
+  E.rowsize = realloc(E.rowsize, sizeof(int) * cap);
+  E.rowrsize = realloc(E.rowrsize, sizeof(int) * cap);
+  E.rowflags = realloc(E.rowflags, cap);
+  E.rowdiskoff = realloc(E.rowdiskoff, sizeof(off_t) * cap);
+  if (!E.row || !E.rowsize || !E.rowrsize || !E.rowflags || !E.rowdiskoff)
+    die("realloc");
+  if (E.rowsig) {
+    E.rowsig = realloc(E.rowsig, sizeof(uint64_t) * KILO_TRIGRAM_WORDS * cap);
+    if (E.rowsig == NULL) die("realloc");
+  }
+  E.rowcap = cap;
+}
+
+/**
+ * @brief Moves a range of rows along with their metadata
+ * 
+ * @param to the index the first row moves to
+ * @param from the index of the first row to move
+ * @param n the number of rows to move
+ */
+void editorRowsMove(int to, int from, int n) {
+  memmove(&E.row[to], &E.row[from], sizeof(erow) * n);
+  memmove(&E.rowsize[to], &E.rowsize[from], sizeof(int) * n);
+  memmove(&E.rowrsize[to], &E.rowrsize[from], sizeof(int) * n);
+  memmove(&E.rowflags[to], &E.rowflags[from], n);
+  memmove(&E.rowdiskoff[to], &E.rowdiskoff[from], sizeof(off_t) * n);
+  if (E.rowsig == NULL || n == 0) return;
+  memmove(&E.rowsig[(size_t)to * KILO_TRIGRAM_WORDS],
+          &E.rowsig[(size_t)from * KILO_TRIGRAM_WORDS],
+          sizeof(uint64_t) * KILO_TRIGRAM_WORDS * n);
+  if (from < E.trigram->numrows || to < E.trigram->numrows)
+    E.trigram->moved = 1;
+}
+
 /**
  * @brief Insert a row at a given index
  * 
@@ -630,17 +2624,18 @@ void editorUpdateRow(erow *row) {
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return;
 
-  // Allocate space for an extra row and move the old data to the new 
-  // memory location
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j < E.numrows; j++) E.row[j].idx++;
+  // Make space for an extra row and shift the rows after it, along with
+  // their metadata
+  editorRowsReserve(E.numrows + 1);
+  editorRowsMove(at + 1, at, E.numrows - at);
+  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+  E.rowflags[at] = 0;
 
   E.row[at].idx = at;
 
   // Set at to the index of the new row
   E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
+  E.row[at].chars = rowPoolAlloc(&E.pool, len + 1);
   // Replace row[at] with
   memcpy(E.row[at].chars, s, len);
   E.row[at].chars[len] = '\0';
@@ -648,11 +2643,16 @@ void editorInsertRow(int at, char *s, size_t len) {
   E.row[at].rsize = 0;
   E.row[at].render = NULL;
   E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
+  E.row[at].tabs = NULL;
+  E.row[at].ntabs = 0;
+  E.row[at].gen = E.gen;
+  if (E.rowtree) rowTreeInsert(at, E.row[at].chars, len);
   editorUpdateRow(&E.row[at]);
 
   E.numrows++;
   E.dirty++;
+  editorJournalRecord(JOURNAL_INSERT_ROW, at, 0, s, len);
+  editorUndoInsertRows(at, 1);
 }
 
 /**
@@ -661,9 +2661,40 @@ void editorInsertRow(int at, char *s, size_t len) {
  * @param row the row to deallocate
  */
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  editorRowFreeRender(row);
+  if (editorRowIsShared(row)) editorRetire(row->chars);
+  else rowPoolFree(&E.pool, row->chars);
+  rowPoolFree(&E.pool, row->hl);
+}
+
+/**
+ * @brief Drops every row in the buffer
+ * 
+ * All row data lives in E.pool, so this releases the slabs wholesale instead
+ * of freeing each row one by one.
+ */
+void editorFreeBuffer(void) {
+  // A background save may still be reading the rows
+  editorWaitSave();
+  editorTrigramStop();
+  rowPoolClear(&E.pool);
+  if (E.rowtree) rowNodeRelease(E.rowtree);
+  E.rowtree = NULL;
+  E.nretired = 0;
+  free(E.row);
+  free(E.rowsize);
+  free(E.rowrsize);
+  free(E.rowflags);
+  free(E.rowdiskoff);
+  E.row = NULL;
+  E.rowsize = NULL;
+  E.rowrsize = NULL;
+  E.rowflags = NULL;
+  E.rowdiskoff = NULL;
+  E.rowcap = 0;
+  E.numrows = 0;
+  E.disk_valid = 0;
+  editorUndoReset();
 }
 
 /**
@@ -675,15 +2706,18 @@ void editorFreeRow(erow *row) {
  */
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return; 
+  editorUndoDeleteRows(at, 1);
 
   // Free the memory owned by the row
   editorFreeRow(&E.row[at]);
+  if (E.rowtree) rowTreeDelete(at);
 
   // Overwrite the deleted row struct with the rest of the rows that come after it
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  editorRowsMove(at, at + 1, E.numrows - at - 1);
   for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
   E.numrows--;
   E.dirty++;
+  editorJournalRecord(JOURNAL_DEL_ROW, at, 0, NULL, 0);
 }
 
 /**
@@ -702,7 +2736,8 @@ void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
 
   // Allocate memory for one new char plus the null char (end of string)
-  row->chars = realloc(row->chars, row->size + 2);
+  editorRowUnshare(row);
+  row->chars = rowPoolRealloc(&E.pool, row->chars, row->size + 2);
 
   // Make room for the new char by allocating a new block of memory for rows.chars
   // Only need to reallocate the chars that include and come after at
@@ -713,6 +2748,8 @@ void editorRowInsertChar(erow *row, int at, int c) {
   row->chars[at] = c;
   editorUpdateRow(row);
   E.dirty++;
+  editorJournalRecord(JOURNAL_INSERT_CHAR, row->idx, at, &row->chars[at], 1);
+  editorUndoInsert(row->idx, at, &row->chars[at], 1);
 }
 
 /**
@@ -723,211 +2760,4800 @@ void editorRowInsertChar(erow *row, int at, int c) {
  * @param len the length of of the string to add
  */
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+  editorUndoInsert(row->idx, row->size, s, len);
+  editorRowUnshare(row);
+  row->chars = rowPoolRealloc(&E.pool, row->chars, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
   editorUpdateRow(row);
   E.dirty++;
+  editorJournalRecord(JOURNAL_APPEND, row->idx, 0, s, len);
+}
+
+/**
+ * @brief Dels a char in a row
+ * 
+ * @param row a row to delete a char in
+ * @param at the index of the char to delete
+ */
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorUndoDelete(row->idx, at, &row->chars[at], 1);
+  editorRowUnshare(row);
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  row->size--;
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(JOURNAL_DEL_CHAR, row->idx, at, NULL, 0);
+}
+
+/**
+ * @brief Cuts a row off at a given length
+ * 
+ * @param row the row to shorten
+ * @param len the new length of the row
+ */
+void editorRowTruncate(erow *row, int len) {
+  if (len < 0 || len >= row->size) return;
+  editorUndoDelete(row->idx, len, &row->chars[len], row->size - len);
+  editorRowUnshare(row);
+  row->size = len;
+  row->chars[len] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(JOURNAL_TRUNCATE, row->idx, len, NULL, 0);
+}
+
+/**
+ * @brief Inserts a string at a given index of a row
+ * 
+ * @param row the row to insert into
+ * @param at the index to insert at, clamped to the end of the row
+ * @param s the string to insert
+ * @param len the length of the string
+ */
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorUndoInsert(row->idx, at, s, len);
+  editorRowUnshare(row);
+  row->chars = rowPoolRealloc(&E.pool, row->chars, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(JOURNAL_INSERT_STRING, row->idx, at, s, len);
+}
+
+/**
+ * @brief Deletes a range of chars from a row
+ * 
+ * @param row the row to delete from
+ * @param at the index of the first char to delete
+ * @param len the number of chars to delete
+ */
+void editorRowDelRange(erow *row, int at, int len) {
+  if (at < 0 || len <= 0 || at + len > row->size) return;
+  editorUndoDelete(row->idx, at, &row->chars[at], len);
+  editorRowUnshare(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(JOURNAL_DEL_RANGE, row->idx, at, NULL, len);
+}
+
+/**
+ * @brief Replaces the whole text of a row
+ * 
+ * However much of the row changes, it is rendered and highlighted once.
+ * 
+ * @param row the row
+ * @param s the new text
+ * @param len the length of the new text
+ */
+void editorRowSet(erow *row, const char *s, size_t len) {
+  editorUndoDelete(row->idx, 0, row->chars, row->size);
+  editorUndoInsert(row->idx, 0, s, len);
+
+  // A row shared with a snapshot is not copied only to be overwritten
+  if (editorRowIsShared(row)) {
+    editorRetire(row->chars);
+    row->chars = rowPoolAlloc(&E.pool, len + 1);
+    row->gen = E.gen;
+  } else {
+    row->chars = rowPoolRealloc(&E.pool, row->chars, len + 1);
+  }
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  editorUpdateRow(row);
+  E.dirty++;
+  editorJournalRecord(JOURNAL_SET_ROW, row->idx, 0, s, len);
+}
+
+/**
+ * @brief Inserts several rows at once
+ * 
+ * The rows after at are only shifted once, so this is linear in the size of
+ * the buffer however many rows are inserted.
+ * 
+ * @param at the index to insert the rows at
+ * @param n the number of rows
+ * @param blob the rows back to back, each one preceded by its length as an int
+ */
+void editorInsertRows(int at, int n, const char *blob) {
+  if (at < 0 || at > E.numrows || n <= 0) return;
+
+  editorRowsReserve(E.numrows + n);
+  editorRowsMove(at + n, at, E.numrows - at);
+  for (int j = at + n; j < E.numrows + n; j++) E.row[j].idx += n;
+
+  const char *p = blob;
+  for (int i = 0; i < n; i++) {
+    int len;
+    memcpy(&len, p, sizeof(int));
+    p += sizeof(int);
+
+    erow *row = &E.row[at + i];
+    row->idx = at + i;
+    row->size = len;
+    row->chars = rowPoolAlloc(&E.pool, len + 1);
+    memcpy(row->chars, p, len);
+    row->chars[len] = '\0';
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->tabs = NULL;
+    row->ntabs = 0;
+    row->gen = E.gen;
+    E.rowflags[at + i] = 0;
+    if (E.rowtree) rowTreeInsert(at + i, row->chars, len);
+    p += len;
+  }
+  E.numrows += n;
+
+  // Only render once every new row exists, since highlighting may look at
+  // the next row
+  for (int i = 0; i < n; i++) editorUpdateRow(&E.row[at + i]);
+
+  E.dirty++;
+  editorJournalRecord(JOURNAL_INSERT_ROWS, at, n, blob, p - blob);
+  editorUndoInsertRows(at, n);
+}
+
+/**
+ * @brief Deletes several consecutive rows at once
+ * 
+ * @param at the index of the first row to delete
+ * @param n the number of rows
+ */
+void editorDelRows(int at, int n) {
+  if (at < 0 || n <= 0 || at + n > E.numrows) return;
+  editorUndoDeleteRows(at, n);
+
+  for (int i = 0; i < n; i++) {
+    editorFreeRow(&E.row[at + i]);
+    if (E.rowtree) rowTreeDelete(at);
+  }
+  editorRowsMove(at, at + n, E.numrows - at - n);
+  for (int j = at; j < E.numrows - n; j++) E.row[j].idx -= n;
+  E.numrows -= n;
+  E.dirty++;
+  editorJournalRecord(JOURNAL_DEL_ROWS, at, 0, NULL, n);
+}
+
+/*** editor operations ***/
+
+/**
+ * @brief Called by editorProcessKeypress() to map a basic char to
+ * an operation in the text editor.
+ * 
+ * Functions in editor operations don't have to worry about the details of modifying an erow
+ * 
+ * @param c a char c to insert at the location of the cursor
+ */
+void editorInsertChar(int c) {
+  editorUndoBegin(UNDO_KIND_TYPE);
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+  editorUndoEnd();
+}
+
+/**
+ * @brief Deletes the cursor at the location of the cursor
+ * 
+ */
+void editorDelChar(void) {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+  editorUndoBegin(UNDO_KIND_DELETE);
+
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    // If the row is empty, delete the whole row
+    E.cx = E.row[E.cy - 1].size;
+    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+  editorUndoEnd();
+}
+
+/**
+ * @brief Supports the inserting of a new line, if we are at the end
+ * of the last line.
+ */
+void editorInsertNewline(void) {
+  editorUndoBegin(UNDO_KIND_TYPE);
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    erow *row = &E.row[E.cy];
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    editorRowTruncate(&E.row[E.cy], E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+  editorUndoEnd();
+}
+
+/*** file i/o ***/
+
+/**
+ * @brief Reads the monotonic clock
+ * 
+ * Returns the time in nanoseconds, for measuring how long an operation took.
+ */
+long long editorNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Converts a all the text data to a string that will be written to
+ * the disk eventually.
+ * 
+ * @param buflen the length of the textbuffer that needs to be parsed
+ */
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+
+  // Add up the lengths of each row of text, including the newline char
+  for (j = 0; j < E.numrows; j++)
+    totlen += E.rowsize[j] + 1;
+  *buflen = totlen;
+
+  // Allocate the required memory and memcpy the contents of each row to the end of the buffer
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (j = 0; j < E.numrows; j++) {
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  // Expect the caller to free memory when it is done
+  return buf;
+}
+
+/**
+ * @brief Computes the size of the buffer as it will be written to disk
+ */
+off_t editorRowsLength(void) {
+  off_t totlen = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++)
+    totlen += (off_t)E.rowsize[j] + 1;
+  return totlen;
+}
+
+/**
+ * @brief Fills an iovec array with rows, each followed by a newline
+ * 
+ * @param iov the array to fill
+ * @param max the number of entries in iov
+ * @param it the position of the next row to add in a snapshot
+ * @param left the number of rows still to add, decreased by the rows added
+ * @param bytes set to the number of bytes the iovecs cover
+ */
+int editorFillRowIovecs(struct iovec *iov, int max, struct rowIter *it,
+                        int *left, size_t *bytes) {
+  static char newline = '\n';
+  int cnt = 0;
+  char *chars;
+  int size;
+  *bytes = 0;
+  while (*left > 0 && cnt + 2 <= max && rowIterNext(it, &chars, &size)) {
+    if (size > 0) {
+      iov[cnt].iov_base = chars;
+      iov[cnt].iov_len = size;
+      cnt++;
+    }
+    iov[cnt].iov_base = &newline;
+    iov[cnt].iov_len = 1;
+    cnt++;
+    *bytes += size + 1;
+    (*left)--;
+  }
+  return cnt;
+}
+
+/**
+ * @brief Moves past the part of an iovec array that was already written
+ * 
+ * Skips the iovecs that were fully written and trims the partial one.
+ * Returns the number of iovecs left.
+ * 
+ * @param iov the first unwritten iovec, advanced in place
+ * @param cnt the number of iovecs left
+ * @param n the number of bytes written
+ */
+int editorAdvanceIovecs(struct iovec **iov, int cnt, size_t n) {
+  struct iovec *cur = *iov;
+  while (cnt > 0 && n >= cur->iov_len) {
+    n -= cur->iov_len;
+    cur++;
+    cnt--;
+  }
+  if (cnt > 0) {
+    cur->iov_base = (char *)cur->iov_base + n;
+    cur->iov_len -= n;
+  }
+  *iov = cur;
+  return cnt;
+}
+
+#ifdef KILO_HAVE_IO_URING
+
+/** @struct uring
+ *  @brief A minimal io_uring instance driven through the raw system calls
+ * 
+ *  @var foreignstruct::fd
+ *  Member 'fd' the io_uring file descriptor
+ * 
+ *  @var foreignstruct::pending
+ *  Member 'pending' the number of queued entries not submitted yet
+ */
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+  unsigned sq_entries;
+  unsigned pending;
+};
+
+/**
+ * @brief Tears down a ring set up by uringInit()
+ * 
+ * @param r the ring
+ */
+void uringFree(struct uring *r) {
+  if (r->sqes) munmap(r->sqes, r->sqes_len);
+  if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+  if (r->sq_map) munmap(r->sq_map, r->sq_map_len);
+  if (r->fd >= 0) close(r->fd);
+}
+
+/**
+ * @brief Sets up a ring and maps its submission and completion queues
+ * 
+ * Fails when the kernel has no io_uring or does not let us use it.
+ * 
+ * @param r the ring to set up
+ * @param entries the submission queue size
+ */
+int uringInit(struct uring *r, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) return -1;
+
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) goto fail;
+  r->cq_map = single ? r->sq_map
+                     : mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  if (r->cq_map == MAP_FAILED) goto fail;
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) goto fail;
+
+  char *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->sq_entries = p.sq_entries;
+  return 0;
+
+fail:
+  if (r->sq_map == MAP_FAILED) r->sq_map = NULL;
+  if (r->cq_map == MAP_FAILED) r->cq_map = NULL;
+  if (r->sqes == MAP_FAILED) r->sqes = NULL;
+  uringFree(r);
+  return -1;
+}
+
+/**
+ * @brief Returns a cleared submission queue entry, or NULL if the queue is full
+ * 
+ * @param r the ring
+ */
+struct io_uring_sqe *uringGetSqe(struct uring *r) {
+  unsigned tail = *r->sq_tail + r->pending;
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (tail - head >= r->sq_entries) return NULL;
+
+  unsigned idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  r->pending++;
+  return sqe;
+}
+
+/**
+ * @brief Submits the queued entries and optionally waits for a completion
+ * 
+ * @param r the ring
+ * @param wait the number of completions to wait for
+ */
+int uringSubmit(struct uring *r, unsigned wait) {
+  unsigned n = r->pending;
+  if (n) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->pending = 0;
+  }
+  for (;;) {
+    long ret = syscall(__NR_io_uring_enter, r->fd, n, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0) return 0;
+    if (errno != EINTR) return -1;
+  }
+}
+
+/**
+ * @brief Waits for the next completion and consumes it
+ * 
+ * @param r the ring
+ * @param user_data set to the user_data of the completed request
+ * @param res set to the result of the completed request
+ */
+int uringWait(struct uring *r, unsigned long long *user_data, int *res) {
+  for (;;) {
+    unsigned head = *r->cq_head;
+    if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      *user_data = cqe->user_data;
+      *res = cqe->res;
+      __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+      return 0;
+    }
+    if (uringSubmit(r, 1) == -1) return -1;
+  }
+}
+
+/** @struct uringWrite
+ *  @brief One writev request in flight on the ring
+ */
+struct uringWrite {
+  struct iovec iov[KILO_IOV_BATCH];
+  int cnt;
+  off_t off;
+  size_t bytes;
+};
+
+/**
+ * @brief Finishes a writev that the kernel only partially completed
+ * 
+ * @param fd the file descriptor
+ * @param w the request
+ * @param done the number of bytes the kernel wrote
+ */
+int editorUringFinishWrite(int fd, struct uringWrite *w, size_t done) {
+  struct iovec *cur = w->iov;
+  int cnt = editorAdvanceIovecs(&cur, w->cnt, done);
+  off_t off = w->off + done;
+  while (cnt > 0) {
+    ssize_t n = pwritev(fd, cur, cnt, off);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    off += n;
+    cnt = editorAdvanceIovecs(&cur, cnt, n);
+  }
+  return 0;
+}
+
+/**
+ * @brief Sets up the ring the writes of one save are queued on
+ * 
+ * Returns NULL if io_uring cannot be used, in which case the rows are
+ * written with writev().
+ */
+struct uring *editorUringOpen(void) {
+  struct uring *r = malloc(sizeof(*r));
+  if (r == NULL) return NULL;
+  if (uringInit(r, KILO_URING_DEPTH) == -1) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+/**
+ * @brief Tears down a ring set up by editorUringOpen()
+ * 
+ * @param r the ring, or NULL
+ */
+void editorUringClose(struct uring *r) {
+  if (r == NULL) return;
+  uringFree(r);
+  free(r);
+}
+
+/**
+ * @brief Writes rows at a file offset with queued io_uring writev requests
+ * 
+ * Up to KILO_URING_DEPTH batches of row iovecs are in flight at a time,
+ * each aimed at its own offset, so the kernel always has the next batch
+ * ready. Like editorWriteRows() the iovecs point straight at the rows.
+ * 
+ * @param r the ring to queue the writes on
+ * @param fd the file descriptor to write to
+ * @param snap the snapshot to take the rows from
+ * @param first the index of the first row to write
+ * @param numrows the number of rows
+ * @param off the offset to write the first row at
+ */
+int editorUringWriteRows(struct uring *r, int fd, struct rowNode *snap,
+                         int first, int numrows, off_t off) {
+  struct uringWrite *w = malloc(sizeof(*w) * KILO_URING_DEPTH);
+  if (w == NULL) return -1;
+
+  int free_slots[KILO_URING_DEPTH];
+  int nfree = KILO_URING_DEPTH, inflight = 0, err = 0;
+  for (int i = 0; i < KILO_URING_DEPTH; i++) free_slots[i] = i;
+
+  struct rowIter it;
+  rowIterInit(&it, snap, first);
+  while ((numrows > 0 && !err) || inflight > 0) {
+    // Keep the queue full while there are rows left
+    while (numrows > 0 && !err && nfree > 0) {
+      int slot = free_slots[--nfree];
+      struct uringWrite *cur = &w[slot];
+      cur->off = off;
+      cur->cnt = editorFillRowIovecs(cur->iov, KILO_IOV_BATCH, &it, &numrows,
+                                     &cur->bytes);
+      off += cur->bytes;
+
+      struct io_uring_sqe *sqe = uringGetSqe(r);
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long)cur->iov;
+      sqe->len = cur->cnt;
+      sqe->off = cur->off;
+      sqe->user_data = slot;
+      inflight++;
+    }
+
+    unsigned long long slot;
+    int res;
+    if (uringWait(r, &slot, &res) == -1) {
+      // Without completions the iovecs cannot be reused safely
+      err = errno;
+      break;
+    }
+    inflight--;
+    if (res < 0) {
+      if (!err) err = -res;
+    } else if ((size_t)res < w[slot].bytes && !err) {
+      if (editorUringFinishWrite(fd, &w[slot], res) == -1) err = errno;
+    }
+    free_slots[nfree++] = slot;
+  }
+
+  free(w);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+#else
+
+struct uring;
+
+struct uring *editorUringOpen(void) {
+  return NULL;
+}
+
+void editorUringClose(struct uring *r) {
+  (void)r;
+}
+
+#endif
+
+/**
+ * @brief Writes rows to a file descriptor, each followed by a newline
+ * 
+ * Rather than copying the buffer into one big string first, writev() is fed
+ * batches of iovecs that point straight at each row's chars. Short writes
+ * are resumed from wherever the kernel stopped.
+ * 
+ * @param fd the file descriptor to write to
+ * @param snap the snapshot to take the rows from
+ * @param first the index of the first row to write
+ * @param numrows the number of rows
+ */
+int editorWriteRows(int fd, struct rowNode *snap, int first, int numrows) {
+  struct iovec iov[KILO_IOV_BATCH];
+  struct rowIter it;
+  rowIterInit(&it, snap, first);
+
+  while (numrows > 0) {
+    size_t bytes;
+    int cnt = editorFillRowIovecs(iov, KILO_IOV_BATCH, &it, &numrows, &bytes);
+    if (cnt == 0) break;
+
+    struct iovec *cur = iov;
+    while (cnt > 0) {
+      ssize_t n = writev(fd, cur, cnt);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      cnt = editorAdvanceIovecs(&cur, cnt, n);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Writes rows at a given file offset
+ * 
+ * Goes through io_uring when the save has a ring and falls back to seeking
+ * and editorWriteRows() otherwise.
+ * 
+ * @param ring the ring of the save, or NULL
+ * @param fd the file descriptor to write to
+ * @param snap the snapshot to take the rows from
+ * @param first the index of the first row to write
+ * @param numrows the number of rows
+ * @param off the offset to write the first row at
+ */
+int editorWriteRowsAt(struct uring *ring, int fd, struct rowNode *snap,
+                      int first, int numrows, off_t off) {
+#ifdef KILO_HAVE_IO_URING
+  if (ring) return editorUringWriteRows(ring, fd, snap, first, numrows, off);
+#else
+  (void)ring;
+#endif
+  if (lseek(fd, off, SEEK_SET) == -1) return -1;
+  return editorWriteRows(fd, snap, first, numrows);
+}
+
+/**
+ * @brief Flushes a directory entry to disk
+ * 
+ * After a rename() the new name is only durable once the directory that
+ * holds it has been synced as well.
+ * 
+ * @param path the file whose parent directory should be synced
+ */
+int editorSyncParentDir(const char *path) {
+  char *slash = strrchr(path, '/');
+  char *dir;
+  if (slash == NULL) dir = strdup(".");
+  else if (slash == path) dir = strdup("/");
+  else dir = strndup(path, slash - path);
+  if (dir == NULL) return -1;
+
+  int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd == -1) return -1;
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
+
+/**
+ * @brief Sets the length of a file and allocates its blocks
+ * 
+ * ftruncate() alone only leaves a hole, so a full disk would show up part
+ * way through the writes instead. Where the filesystem cannot allocate
+ * ahead, or outside Linux, only the length is set.
+ * 
+ * @param fd the file descriptor
+ * @param len the length of the file
+ */
+int editorReserveFile(int fd, off_t len) {
+#ifdef __linux__
+  int err = posix_fallocate(fd, 0, len);
+  if (err == 0) return 0;
+  if (err != EINVAL && err != EOPNOTSUPP) {
+    errno = err;
+    return -1;
+  }
+#endif
+  return ftruncate(fd, len);
+}
+
+/**
+ * @brief Atomically replaces a file with the given rows
+ * 
+ * The rows are written to a temporary file next to the target, which then
+ * takes over the target's permissions and ownership and is renamed over it.
+ * A crash at any point leaves either the old or the new contents on disk,
+ * never a truncated mix. With KILO_DURABLE_SAVE the data and the directory
+ * entry are also fsynced before returning. Renaming over the target breaks
+ * any hard links to it; symlinks are followed so the link itself survives.
+ * 
+ * @param ring the ring of the save, or NULL
+ * @param filename the file to replace
+ * @param snap the snapshot to write
+ * @param len the total number of bytes that will be written
+ */
+int editorSaveFile(struct uring *ring, const char *filename,
+                   struct rowNode *snap, off_t len) {
+  // Write next to the real file, not next to a symlink pointing at it
+  char *target = realpath(filename, NULL);
+  if (target == NULL) {
+    if (errno != ENOENT) return -1;
+    target = strdup(filename);
+    if (target == NULL) return -1;
+  }
+
+  struct stat st;
+  int exists = (stat(target, &st) == 0);
+
+  // The temporary file is hidden and lives in the same directory so that
+  // rename() stays on one filesystem
+  char *slash = strrchr(target, '/');
+  int dirlen = slash ? (int)(slash - target) + 1 : 0;
+  size_t tmplen = strlen(target) + 16;
+  char *tmp = malloc(tmplen);
+  if (tmp == NULL) {
+    free(target);
+    return -1;
+  }
+  snprintf(tmp, tmplen, "%.*s.%s.XXXXXX", dirlen, target, target + dirlen);
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) goto fail;
+
+  if (exists) {
+    // Ownership can only be kept when we are allowed to give it away, which
+    // is not worth failing the save over
+    if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM) goto fail_fd;
+    if (fchmod(fd, st.st_mode & 07777) == -1) goto fail_fd;
+  } else {
+    if (fchmod(fd, 0644) == -1) goto fail_fd;
+  }
+
+  // Reserve the space up front so running out of disk fails before the
+  // rows are written
+  if (editorReserveFile(fd, len) == -1) goto fail_fd;
+  if (editorWriteRowsAt(ring, fd, snap, 0, snap->count, 0) == -1) goto fail_fd;
+  if (KILO_DURABLE_SAVE && fsync(fd) == -1) goto fail_fd;
+  if (close(fd) == -1) {
+    fd = -1;
+    goto fail_unlink;
+  }
+  fd = -1;
+
+  if (rename(tmp, target) == -1) goto fail_unlink;
+  if (KILO_DURABLE_SAVE) editorSyncParentDir(target);
+
+  free(tmp);
+  free(target);
+  return 0;
+
+fail_fd:
+  close(fd);
+fail_unlink:
+  {
+    int saved_errno = errno;
+    unlink(tmp);
+    errno = saved_errno;
+  }
+fail:
+  free(tmp);
+  free(target);
+  return -1;
+}
+
+/** @struct saveExtent
+ *  @brief A run of consecutive changed rows and where they go in the file
+ * 
+ *  @var foreignstruct::row
+ *  Member 'row' the index of the first row of the run
+ * 
+ *  @var foreignstruct::count
+ *  Member 'count' the number of rows in the run
+ * 
+ *  @var foreignstruct::off
+ *  Member 'off' the file offset the run starts at
+ */
+struct saveExtent {
+  int row;
+  int count;
+  off_t off;
+};
+
+/**
+ * @brief Checks that two stat() timestamps are equal to the nanosecond
+ * 
+ * @param a the first timestamp
+ * @param b the second timestamp
+ */
+int editorTimeEqual(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/**
+ * @brief Checks that the file on disk is still the one the editor last
+ * read or wrote
+ * 
+ * Timestamps are compared to the nanosecond, so a write landing in the same
+ * second as the last read or save is still noticed on filesystems that
+ * record finer times.
+ * 
+ * @param filename the file to check
+ */
+int editorDiskUnchanged(const char *filename) {
+  struct stat st;
+  if (!E.disk_valid || stat(filename, &st) == -1) return 0;
+  return st.st_dev == E.disk.st_dev && st.st_ino == E.disk.st_ino &&
+         st.st_size == E.disk.st_size &&
+         editorTimeEqual(st.st_mtim, E.disk.st_mtim) &&
+         editorTimeEqual(st.st_ctim, E.disk.st_ctim);
+}
+
+/**
+ * @brief Works out whether a save can patch the file in place
+ * 
+ * Walks E.rowdiskoff alongside the offsets the rows will have in the new
+ * file. Every unchanged row must still sit at its old offset, which holds
+ * as long as no edit changed the length of what comes before it. The changed
+ * rows then exactly fill the gaps between unchanged ones, or extend the file
+ * at the end. Returns the number of runs of changed rows stored in
+ * *extents, or -1 if the whole file has to be rewritten.
+ * 
+ * @param extents set to a malloc'd array of changed runs
+ * @param len set to the size the file will have after the save
+ */
+int editorPlanIncrementalSave(struct saveExtent **extents, off_t *len) {
+  int possible = KILO_INCREMENTAL_SAVE && editorDiskUnchanged(E.filename);
+  struct saveExtent *ext = NULL;
+  int n = 0, cap = 0;
+  off_t off = 0, changed = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    off_t rowlen = (off_t)E.rowsize[j] + 1;
+    if (!possible || E.rowdiskoff[j] == off) {
+      off += rowlen;
+      continue;
+    }
+    if (E.rowdiskoff[j] != -1) {
+      // An unchanged row moved, so everything after it has to be rewritten
+      possible = 0;
+      off += rowlen;
+      continue;
+    }
+
+    if (n > 0 && ext[n - 1].row + ext[n - 1].count == j) {
+      ext[n - 1].count++;
+    } else {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 16;
+        ext = realloc(ext, sizeof(*ext) * cap);
+        if (ext == NULL) die("realloc");
+      }
+      ext[n].row = j;
+      ext[n].count = 1;
+      ext[n].off = off;
+      n++;
+    }
+    changed += rowlen;
+    off += rowlen;
+  }
+
+  *len = off;
+
+  // Patching most of the file gives up atomicity for little gain
+  if (!possible || changed > off / 2) {
+    free(ext);
+    *extents = NULL;
+    return -1;
+  }
+  *extents = ext;
+  return n;
+}
+
+/**
+ * @brief Writes only the changed runs of rows into the existing file
+ * 
+ * Unlike editorSaveFile() this modifies the file in place: a crash in the
+ * middle can leave some runs written and others not.
+ * 
+ * @param ring the ring of the save, or NULL
+ * @param filename the file to patch
+ * @param snap the snapshot to take the runs from
+ * @param extents the runs of changed rows
+ * @param nextents the number of runs
+ * @param len the size the file will have afterwards
+ */
+int editorSaveExtents(struct uring *ring, const char *filename,
+                      struct rowNode *snap, struct saveExtent *extents,
+                      int nextents, off_t len) {
+  int fd = open(filename, O_WRONLY);
+  if (fd == -1) return -1;
+
+  int i;
+  for (i = 0; i < nextents; i++) {
+    if (editorWriteRowsAt(ring, fd, snap, extents[i].row, extents[i].count,
+                          extents[i].off) == -1)
+      goto fail;
+  }
+
+  // Drop whatever followed the last row if the file got shorter
+  if (ftruncate(fd, len) == -1) goto fail;
+  if (KILO_DURABLE_SAVE && fsync(fd) == -1) goto fail;
+  return close(fd);
+
+fail:
+  {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+  }
+  return -1;
+}
+
+/**
+ * @brief Records where every row lives in the file being saved
+ */
+void editorSetRowDiskOffsets(void) {
+  off_t off = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    E.rowdiskoff[j] = off;
+    off += (off_t)E.rowsize[j] + 1;
+  }
+}
+
+/** @struct saveJob
+ *  @brief A save running on a background thread
+ * 
+ *  @var foreignstruct::filename
+ *  Member 'filename' a private copy of the file name being written
+ * 
+ *  @var foreignstruct::rows
+ *  Member 'rows' the snapshot of the buffer being written
+ * 
+ *  @var foreignstruct::dirty
+ *  Member 'dirty' the value of E.dirty when the snapshot was taken
+ * 
+ *  @var foreignstruct::done
+ *  Member 'done' set by the writer thread under lock once it has finished
+ * 
+ *  @var foreignstruct::extents
+ *  Member 'extents' the runs of changed rows to patch in place, only used when
+ * nextents is not -1
+ * 
+ *  @var foreignstruct::err
+ *  Member 'err' 0 on success, otherwise the errno of the failure
+ * 
+ *  @var foreignstruct::st
+ *  Member 'st' the stat of the file right after it was written
+ */
+struct saveJob {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  char *filename;
+  struct rowNode *rows;
+  off_t len;
+  struct saveExtent *extents;
+  int nextents;
+  int dirty;
+  long long start;
+  long long elapsed;
+  int done;
+  int err;
+  struct stat st;
+};
+
+/**
+ * @brief Entry point of the background writer thread
+ * 
+ * @param arg the saveJob to run
+ */
+void *editorSaveThread(void *arg) {
+  struct saveJob *job = arg;
+  int err = 0;
+  int r;
+  long long start = editorTraceBegin();
+  // One ring serves every write of the save
+  struct uring *ring = editorUringOpen();
+  if (job->nextents == -1)
+    r = editorSaveFile(ring, job->filename, job->rows, job->len);
+  else
+    r = editorSaveExtents(ring, job->filename, job->rows, job->extents,
+                          job->nextents, job->len);
+  editorUringClose(ring);
+  if (r == -1 || stat(job->filename, &job->st) == -1) err = errno;
+  editorTraceEnd("save", "io", start);
+
+  pthread_mutex_lock(&job->lock);
+  job->err = err;
+  job->elapsed = editorNowNs() - job->start;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+/**
+ * @brief Collects a finished background save
+ * 
+ * Joins the writer, releases its snapshot and reports the outcome. Only the
+ * edits made before the snapshot are taken off E.dirty, so anything typed
+ * while the save was running still counts as unsaved.
+ */
+void editorFinishSave(void) {
+  struct saveJob *job = E.save;
+  pthread_join(job->thread, NULL);
+  editorReleaseSnapshot(job->rows);
+
+  if (job->err == 0) {
+    E.dirty -= job->dirty;
+    if (E.dirty < 0) E.dirty = 0;
+    E.disk = job->st;
+    E.disk_valid = 1;
+    if (job->nextents == -1) {
+      editorSetStatusMessage("%lld bytes written to disk in %.1f ms%s",
+                             (long long)job->len, job->elapsed / 1e6,
+                             KILO_DURABLE_SAVE ? "" : " (no fsync)");
+    } else {
+      editorSetStatusMessage("%d changed runs patched on disk in %.1f ms%s",
+                             job->nextents, job->elapsed / 1e6,
+                             KILO_DURABLE_SAVE ? "" : " (no fsync)");
+    }
+  } else {
+    // The file may now match neither the old nor the new row offsets
+    E.disk_valid = 0;
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  }
+  editorJournalSaveFinished(job->err == 0, &job->st, job->len);
+
+  free(job->extents);
+  pthread_mutex_destroy(&job->lock);
+  free(job->filename);
+  free(job);
+  E.save = NULL;
+}
+
+/**
+ * @brief Reports a background save as soon as it completes
+ * 
+ * Polled from editorPollEvents() while the editor is idle.
+ */
+void editorPollSave(void) {
+  if (E.save == NULL) return;
+
+  pthread_mutex_lock(&E.save->lock);
+  int done = E.save->done;
+  pthread_mutex_unlock(&E.save->lock);
+  if (!done) return;
+
+  editorFinishSave();
+  editorRefreshScreen();
+}
+
+/**
+ * @brief Blocks until the background save, if any, has finished
+ */
+void editorWaitSave(void) {
+  if (E.save) editorFinishSave();
+}
+
+/**
+ * @brief Appends one line read from disk to the buffer
+ * 
+ * Strips the line ending. A line stored exactly as it will be saved, that
+ * is with a lone newline, is recorded as unchanged at its file offset.
+ * 
+ * @param line the raw line, including its line ending if it has one
+ * @param rawlen the length of the raw line
+ * @param off the offset of the line in the file
+ */
+void editorLoadLine(char *line, size_t rawlen, off_t off) {
+  size_t linelen = rawlen;
+  while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                         line[linelen - 1] == '\r'))
+    linelen--;
+  editorInsertRow(E.numrows, line, linelen);
+
+  if (rawlen == linelen + 1 && line[linelen] == '\n')
+    E.rowdiskoff[E.numrows - 1] = off;
+}
+
+/**
+ * @brief Reads a file line by line with stdio
+ * 
+ * @param fd the open file, which is closed when done
+ */
+void editorLoadStdio(int fd) {
+  FILE *fp = fdopen(fd, "r");
+  if (!fp) die("fdopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  off_t off = 0;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    editorLoadLine(line, linelen, off);
+    off += linelen;
+  }
+  free(line);
+  fclose(fp);
+}
+
+#ifdef KILO_HAVE_IO_URING
+
+/**
+ * @brief Splits a chunk of the file into lines
+ * 
+ * Lines that straddle two chunks are collected in carry until their newline
+ * shows up.
+ * 
+ * @param p the chunk
+ * @param len the length of the chunk
+ * @param off the file offset of the chunk
+ * @param carry the partial line left over from earlier chunks
+ * @param carrylen the length of the partial line
+ * @param carrycap the allocated size of carry
+ */
+void editorLoadChunk(char *p, size_t len, off_t off, char **carry,
+                     size_t *carrylen, size_t *carrycap) {
+  char *end = p + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    size_t n = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+
+    if (*carrylen == 0 && nl) {
+      editorLoadLine(p, n, off);
+    } else {
+      if (*carrylen + n > *carrycap) {
+        *carrycap = (*carrylen + n) * 2;
+        *carry = realloc(*carry, *carrycap);
+        if (*carry == NULL) die("realloc");
+      }
+      memcpy(*carry + *carrylen, p, n);
+      *carrylen += n;
+      if (nl) {
+        editorLoadLine(*carry, *carrylen, off + n - *carrylen);
+        *carrylen = 0;
+      }
+    }
+    p += n;
+    off += n;
+  }
+}
+
+/**
+ * @brief Reads a file through io_uring
+ * 
+ * Keeps KILO_URING_DEPTH reads of KILO_URING_CHUNK bytes in flight into
+ * buffers registered with the kernel, and splits each chunk into lines as
+ * soon as it arrives, in file order. Returns KILO_URING_UNAVAILABLE if
+ * io_uring cannot be used or fails part way, with the buffer left empty, so
+ * the caller can fall back to stdio.
+ * 
+ * @param fd the open file, which is closed on success
+ * @param size the size of the file
+ */
+int editorLoadUring(int fd, off_t size) {
+  struct uring r;
+  if (uringInit(&r, KILO_URING_DEPTH) == -1) return KILO_URING_UNAVAILABLE;
+
+  struct iovec bufs[KILO_URING_DEPTH];
+  char *mem = malloc((size_t)KILO_URING_CHUNK * KILO_URING_DEPTH);
+  if (mem == NULL) die("malloc");
+  for (int i = 0; i < KILO_URING_DEPTH; i++) {
+    bufs[i].iov_base = mem + (size_t)i * KILO_URING_CHUNK;
+    bufs[i].iov_len = KILO_URING_CHUNK;
+  }
+  if (syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_BUFFERS, bufs,
+              KILO_URING_DEPTH) < 0) {
+    uringFree(&r);
+    free(mem);
+    return KILO_URING_UNAVAILABLE;
+  }
+
+  long long nchunks = (size + KILO_URING_CHUNK - 1) / KILO_URING_CHUNK;
+  long long next_read = 0, next_line = 0;
+  int done[KILO_URING_DEPTH] = {0};
+  int res[KILO_URING_DEPTH];
+  int inflight = 0;
+  char *carry = NULL;
+  size_t carrylen = 0, carrycap = 0;
+  off_t pos = 0;
+
+  while (next_line < nchunks) {
+    // Chunk k always lands in buffer k % KILO_URING_DEPTH, which is free
+    // again once chunk k - KILO_URING_DEPTH has been split into lines
+    while (next_read < nchunks && next_read < next_line + KILO_URING_DEPTH) {
+      int slot = next_read % KILO_URING_DEPTH;
+      struct io_uring_sqe *sqe = uringGetSqe(&r);
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long)bufs[slot].iov_base;
+      sqe->len = KILO_URING_CHUNK;
+      sqe->off = next_read * KILO_URING_CHUNK;
+      sqe->buf_index = slot;
+      sqe->user_data = slot;
+      next_read++;
+      inflight++;
+    }
+
+    int slot = next_line % KILO_URING_DEPTH;
+    while (!done[slot]) {
+      unsigned long long ud;
+      int rv;
+      if (uringWait(&r, &ud, &rv) == -1) goto fail;
+      inflight--;
+      done[ud] = 1;
+      res[ud] = rv;
+    }
+    if (res[slot] < 0) goto fail;
+
+    pos = next_line * KILO_URING_CHUNK;
+
+    // Reads of a regular file only come up short at its end, but finish
+    // any other short read synchronously rather than lose part of a chunk
+    off_t want = size - pos < KILO_URING_CHUNK ? size - pos : KILO_URING_CHUNK;
+    while (res[slot] < want) {
+      ssize_t n = pread(fd, (char *)bufs[slot].iov_base + res[slot],
+                        want - res[slot], pos + res[slot]);
+      if (n == -1 && errno == EINTR) continue;
+      if (n == -1) goto fail;
+      if (n == 0) break;
+      res[slot] += n;
+    }
+
+    editorLoadChunk(bufs[slot].iov_base, res[slot], pos, &carry, &carrylen,
+                    &carrycap);
+    pos += res[slot];
+    done[slot] = 0;
+    next_line++;
+  }
+
+  // The last line may not end with a newline
+  if (carrylen > 0)
+    editorLoadLine(carry, carrylen, pos - carrylen);
+
+  free(carry);
+  uringFree(&r);
+  free(mem);
+  close(fd);
+  return 0;
+
+fail:
+  // Let the reads still queued finish before their buffers go away
+  while (inflight > 0) {
+    unsigned long long ud;
+    int rv;
+    if (uringWait(&r, &ud, &rv) == -1) break;
+    inflight--;
+  }
+  free(carry);
+  uringFree(&r);
+  free(mem);
+
+  // Start over with stdio; the stat taken by editorOpen() still holds
+  editorFreeBuffer();
+  E.disk_valid = 1;
+  return KILO_URING_UNAVAILABLE;
+}
+
+#endif
+
+/**
+ * @brief Opens a locally stored file by name and reads it line by line.
+ * 
+ * Calls the editorInserRow on each line to insert all of the file's text
+ * contents into the editor. The file is read through io_uring when the
+ * kernel allows it and with stdio otherwise.
+ * 
+ * @param filename the name of the file to open
+ */
+void editorOpen(char *filename) {
+  long long start = editorTraceBegin();
+  editorFreeBuffer();
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+  E.disk_valid = (fstat(fd, &E.disk) == 0);
+
+#ifdef KILO_HAVE_IO_URING
+  if (!E.disk_valid || !S_ISREG(E.disk.st_mode) ||
+      editorLoadUring(fd, E.disk.st_size) == KILO_URING_UNAVAILABLE)
+    editorLoadStdio(fd);
+#else
+  editorLoadStdio(fd);
+#endif
+  E.dirty = 0;
+
+  editorJournalOpen();
+  editorTrigramStart();
+  editorTraceEnd("open", "io", start);
+}
+
+/**
+ * @brief Either creates a new file and opens it, or replaces the existing
+ * file stored in E.filename
+ * 
+ * Takes a snapshot of the buffer and hands it to a writer thread, so editing
+ * can continue while the file is written. The file is written through
+ * editorSaveFile(), so the old contents stay intact until the new ones are
+ * completely on disk. The status message reports how long the save took, to
+ * compare durable and fast saves.
+ */
+void editorSave(void) {
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  if (E.save) {
+    editorSetStatusMessage("A save is already in progress");
+    return;
+  }
+
+  struct saveJob *job = calloc(1, sizeof(*job));
+  if (job == NULL) die("calloc");
+  job->filename = strdup(E.filename);
+  job->nextents = editorPlanIncrementalSave(&job->extents, &job->len);
+  job->rows = editorTakeSnapshot();
+  job->dirty = E.dirty;
+
+  // Rows edited from now on are marked changed again by editorUpdateRow(),
+  // so the offsets can already describe the file being written. The file
+  // itself is only trusted again once the writer reports back
+  editorSetRowDiskOffsets();
+  E.disk_valid = 0;
+  job->start = editorNowNs();
+  pthread_mutex_init(&job->lock, NULL);
+
+  // Leave signals such as SIGWINCH to the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&job->thread, NULL, editorSaveThread, job);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (err != 0) {
+    editorReleaseSnapshot(job->rows);
+    free(job->extents);
+    pthread_mutex_destroy(&job->lock);
+    free(job->filename);
+    free(job);
+    editorSetStatusMessage("Can't save! %s", strerror(err));
+    return;
+  }
+
+  E.save = job;
+  editorJournalSaveStarted();
+  editorSetStatusMessage("Saving %lld bytes...", (long long)job->len);
+}
+
+/*** journal ***/
+
+/** @struct journalBuf
+ *  @brief A growable byte buffer that journal records are encoded into
+ */
+struct journalBuf {
+  char *b;
+  size_t len;
+  size_t cap;
+};
+
+/**
+ * @brief Appends bytes to a journal buffer
+ * 
+ * @param jb the buffer
+ * @param p the bytes to append
+ * @param n the number of bytes
+ */
+void journalBufPut(struct journalBuf *jb, const void *p, size_t n) {
+  if (jb->len + n > jb->cap) {
+    size_t cap = jb->cap ? jb->cap * 2 : 4096;
+    while (cap < jb->len + n) cap *= 2;
+    jb->b = realloc(jb->b, cap);
+    if (jb->b == NULL) die("realloc");
+    jb->cap = cap;
+  }
+  memcpy(jb->b + jb->len, p, n);
+  jb->len += n;
+}
+
+/**
+ * @brief Appends an unsigned integer in LEB128 form, 7 bits per byte
+ * 
+ * @param jb the buffer
+ * @param v the value
+ */
+void journalBufPutVarint(struct journalBuf *jb, uint64_t v) {
+  unsigned char tmp[10];
+  int n = 0;
+  do {
+    tmp[n] = v & 0x7f;
+    v >>= 7;
+    if (v) tmp[n] |= 0x80;
+    n++;
+  } while (v);
+  journalBufPut(jb, tmp, n);
+}
+
+/**
+ * @brief Checks whether a record's length field counts payload bytes
+ * 
+ * JOURNAL_DEL_RANGE and JOURNAL_DEL_ROWS have no payload and use the field
+ * for the number of chars or rows deleted instead.
+ * 
+ * @param op the JOURNAL_* operation
+ */
+int journalHasPayload(int op) {
+  return op != JOURNAL_DEL_RANGE && op != JOURNAL_DEL_ROWS;
+}
+
+/**
+ * @brief Appends one edit record
+ * 
+ * A record is the op byte followed by the row, the column and the payload
+ * length as varints, then the payload itself. A typed character takes about
+ * six bytes.
+ * 
+ * @param jb the buffer
+ * @param op the JOURNAL_* operation
+ * @param row the row index
+ * @param at the column, the new length for JOURNAL_TRUNCATE, or the number of
+ * rows for JOURNAL_INSERT_ROWS
+ * @param s the payload
+ * @param len the length of the payload, or the count for records without one
+ */
+void journalBufPutRecord(struct journalBuf *jb, int op, int row, int at,
+                         const char *s, size_t len) {
+  unsigned char o = op;
+  journalBufPut(jb, &o, 1);
+  journalBufPutVarint(jb, row);
+  journalBufPutVarint(jb, at);
+  journalBufPutVarint(jb, len);
+  if (len && journalHasPayload(op)) journalBufPut(jb, s, len);
+}
+
+/**
+ * @brief Reads a varint written by journalBufPutVarint()
+ * 
+ * Returns -1 if the varint runs past end.
+ * 
+ * @param p the read position, advanced past the varint
+ * @param end the end of the data
+ * @param v set to the value
+ */
+int journalGetVarint(const unsigned char **p, const unsigned char *end,
+                     uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*p == end) return -1;
+    unsigned char b = *(*p)++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return 0;
+  }
+  return -1;
+}
+
+/**
+ * @brief Stores a little-endian integer of the given width
+ * 
+ * @param p where to store it
+ * @param v the value
+ * @param n the width in bytes
+ */
+void journalPutLE(unsigned char *p, uint64_t v, int n) {
+  for (int i = 0; i < n; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+/**
+ * @brief Loads a little-endian integer of the given width
+ * 
+ * @param p where to load it from
+ * @param n the width in bytes
+ */
+uint64_t journalGetLE(const unsigned char *p, int n) {
+  uint64_t v = 0;
+  for (int i = 0; i < n; i++) v |= (uint64_t)p[i] << (8 * i);
+  return v;
+}
+
+/**
+ * @brief Computes the FNV-1a hash that guards every frame against torn writes
+ * 
+ * @param p the data
+ * @param n the length of the data
+ */
+uint32_t journalChecksum(const char *p, size_t n) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Fills in a journal file header
+ * 
+ * The header names the file contents the records apply to by size, mtime
+ * and inode, so a journal is never replayed on top of a file that changed
+ * behind its back.
+ * 
+ * @param h the 32 byte header
+ * @param st the stat of the file the records apply to, NULL if unknown
+ */
+void journalHeader(unsigned char *h, struct stat *st) {
+  memcpy(h, "KILOJNL1", 8);
+  journalPutLE(h + 8, st ? (uint64_t)st->st_size : 0, 8);
+  journalPutLE(h + 16, st ? (uint64_t)st->st_mtime : 0, 8);
+  journalPutLE(h + 24, st ? (uint64_t)st->st_ino : 0, 8);
+}
+
+/**
+ * @brief Writes one frame: its length, its checksum and the records in it
+ * 
+ * @param fd the journal file
+ * @param p the records
+ * @param n the length of the records
+ */
+int journalWriteFrame(int fd, const char *p, size_t n) {
+  unsigned char hdr[8];
+  journalPutLE(hdr, n, 4);
+  journalPutLE(hdr + 4, journalChecksum(p, n), 4);
+
+  struct iovec iov[2];
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (char *)p;
+  iov[1].iov_len = n;
+  struct iovec *cur = iov;
+  int cnt = 2;
+  while (cnt > 0) {
+    ssize_t w = writev(fd, cur, cnt);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    cnt = editorAdvanceIovecs(&cur, cnt, w);
+  }
+  return 0;
+}
+
+/**
+ * @brief Makes the frames written so far durable, when saves are durable
+ * 
+ * @param fd the journal file
+ */
+int journalSync(int fd) {
+  if (!KILO_DURABLE_SAVE) return 0;
+#ifdef __linux__
+  return fdatasync(fd);
+#else
+  return fsync(fd);
+#endif
+}
+
+/** @struct journalRestart
+ *  @brief A request to start the journal file over
+ * 
+ *  @var foreignstruct::header
+ *  Member 'header' the header of the new journal
+ * 
+ *  @var foreignstruct::rows
+ *  Member 'rows' a snapshot to store in full after a JOURNAL_RESET record,
+ * NULL to start from the file named in the header
+ * 
+ *  @var foreignstruct::payload
+ *  Member 'payload' records to carry over into the new journal
+ */
+struct journalRestart {
+  struct journalRestart *next;
+  unsigned char header[32];
+  struct rowNode *rows;
+  struct journalBuf payload;
+};
+
+/** @struct journal
+ *  @brief The crash-recovery journal of unsaved edits
+ * 
+ *  The row primitives encode every edit into pending, which costs a memcpy
+ * under an uncontended lock. A writer thread swaps pending out, appends it to
+ * the journal file as a single checksummed frame and syncs it, so all the
+ * edits that pile up during one sync share the next one. Saving or
+ * compacting starts the file over through a journalRestart.
+ * 
+ *  @var foreignstruct::pending
+ *  Member 'pending' records not handed to the writer yet, under lock
+ * 
+ *  @var foreignstruct::restart
+ *  Member 'restart' the restart the writer should run next, under lock
+ * 
+ *  @var foreignstruct::finished
+ *  Member 'finished' restarts the writer is done with, under lock
+ * 
+ *  @var foreignstruct::err
+ *  Member 'err' the errno of the last failed write, under lock
+ * 
+ *  @var foreignstruct::fd
+ *  Member 'fd' the journal file, only used by the writer
+ * 
+ *  @var foreignstruct::base
+ *  Member 'base' the header naming the file contents the journal applies to
+ * 
+ *  @var foreignstruct::created
+ *  Member 'created' whether the journal file was asked for yet; it is only
+ * created on the first edit
+ * 
+ *  @var foreignstruct::bytes
+ *  Member 'bytes' the bytes recorded since the journal last started over
+ * 
+ *  @var foreignstruct::limit
+ *  Member 'limit' the value of bytes past which the journal is compacted
+ * 
+ *  @var foreignstruct::compacting
+ *  Member 'compacting' whether a compaction is still holding a snapshot
+ * 
+ *  @var foreignstruct::since_save
+ *  Member 'since_save' a copy of the records made while a save is running,
+ * which become the whole journal once the save succeeds
+ */
+struct journal {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *path;
+  struct journalBuf pending;
+  struct journalRestart *restart;
+  struct journalRestart *finished;
+  int stop;
+  int err;
+  int fd;
+  unsigned char base[32];
+  int created;
+  size_t bytes;
+  off_t limit;
+  int compacting;
+  int recording;
+  struct journalBuf since_save;
+};
+
+/**
+ * @brief Builds the path of the journal for a file
+ * 
+ * The journal is a hidden file next to the real file, like the temporary
+ * files used by editorSaveFile().
+ * 
+ * @param filename the file being edited
+ */
+char *editorJournalPath(const char *filename) {
+  char *target = realpath(filename, NULL);
+  if (target == NULL) target = strdup(filename);
+  if (target == NULL) die("strdup");
+
+  char *slash = strrchr(target, '/');
+  int dirlen = slash ? (int)(slash - target) + 1 : 0;
+  size_t len = strlen(target) + 16;
+  char *path = malloc(len);
+  if (path == NULL) die("malloc");
+  snprintf(path, len, "%.*s.%s.kilo-journal", dirlen, target, target + dirlen);
+  free(target);
+  return path;
+}
+
+/**
+ * @brief Computes the compaction threshold for a journal that starts over
+ * from a text of the given size
+ * 
+ * Compacting rewrites the whole text, so waiting until the records outgrow
+ * twice the text keeps the cost per recorded byte constant.
+ * 
+ * @param len the size of the text
+ */
+off_t journalLimit(off_t len) {
+  return 2 * len > KILO_JOURNAL_COMPACT ? 2 * len : KILO_JOURNAL_COMPACT;
+}
+
+/**
+ * @brief Writes a new journal file for a restart and swaps it in
+ * 
+ * Runs on the writer thread. The new journal is written to a temporary file
+ * and renamed over the old one, so a crash leaves one of the two intact.
+ * 
+ * @param j the journal
+ * @param rs the restart
+ */
+int journalRewrite(struct journal *j, struct journalRestart *rs) {
+  size_t tmplen = strlen(j->path) + 8;
+  char *tmp = malloc(tmplen);
+  if (tmp == NULL) return -1;
+  snprintf(tmp, tmplen, "%s.XXXXXX", j->path);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free(tmp);
+    return -1;
+  }
+
+  struct journalBuf jb = {NULL, 0, 0};
+  ssize_t w;
+  do {
+    w = write(fd, rs->header, sizeof(rs->header));
+  } while (w == -1 && errno == EINTR);
+  if (w != (ssize_t)sizeof(rs->header)) goto fail;
+
+  if (rs->rows) {
+    journalBufPutRecord(&jb, JOURNAL_RESET, 0, 0, NULL, 0);
+    struct rowIter it;
+    char *chars;
+    int size;
+    rowIterInit(&it, rs->rows, 0);
+    for (int i = 0; rowIterNext(&it, &chars, &size); i++) {
+      journalBufPutRecord(&jb, JOURNAL_INSERT_ROW, i, 0, chars, size);
+      if (jb.len >= KILO_JOURNAL_FRAME) {
+        if (journalWriteFrame(fd, jb.b, jb.len) == -1) goto fail;
+        jb.len = 0;
+      }
+    }
+    if (jb.len && journalWriteFrame(fd, jb.b, jb.len) == -1) goto fail;
+  }
+  if (rs->payload.len &&
+      journalWriteFrame(fd, rs->payload.b, rs->payload.len) == -1)
+    goto fail;
+
+  if (journalSync(fd) == -1) goto fail;
+  if (rename(tmp, j->path) == -1) goto fail;
+  if (KILO_DURABLE_SAVE) editorSyncParentDir(j->path);
+
+  if (j->fd != -1) close(j->fd);
+  j->fd = fd;
+  free(jb.b);
+  free(tmp);
+  return 0;
+
+fail:
+  {
+    int saved_errno = errno;
+    close(fd);
+    unlink(tmp);
+    errno = saved_errno;
+  }
+  free(jb.b);
+  free(tmp);
+  return -1;
+}
+
+/**
+ * @brief Entry point of the journal writer thread
+ * 
+ * @param arg the journal
+ */
+void *editorJournalThread(void *arg) {
+  struct journal *j = arg;
+  struct journalBuf out = {NULL, 0, 0};
+
+  pthread_mutex_lock(&j->lock);
+  for (;;) {
+    while (!j->pending.len && !j->restart && !j->stop)
+      pthread_cond_wait(&j->cond, &j->lock);
+
+    if (j->restart) {
+      struct journalRestart *rs = j->restart;
+      j->restart = NULL;
+      pthread_mutex_unlock(&j->lock);
+      long long start = editorTraceBegin();
+      int r = journalRewrite(j, rs);
+      int err = errno;
+      editorTraceEnd("journal rewrite", "io", start);
+      pthread_mutex_lock(&j->lock);
+      if (r == -1) j->err = err;
+      rs->next = j->finished;
+      j->finished = rs;
+      continue;
+    }
+    if (!j->pending.len) break;
+
+    // Take the whole group; edits made while it is synced form the next one
+    struct journalBuf t = out;
+    out = j->pending;
+    j->pending = t;
+    j->pending.len = 0;
+    pthread_mutex_unlock(&j->lock);
+
+    int r = 0;
+    long long start = editorTraceBegin();
+    if (j->fd == -1) {
+      r = -1;
+      errno = EBADF;
+    } else if (journalWriteFrame(j->fd, out.b, out.len) == -1 ||
+               journalSync(j->fd) == -1) {
+      r = -1;
+    }
+    int err = errno;
+    editorTraceEnd("journal write", "io", start);
+    out.len = 0;
+
+    pthread_mutex_lock(&j->lock);
+    if (r == -1) j->err = err;
+  }
+  pthread_mutex_unlock(&j->lock);
+
+  free(out.b);
+  return NULL;
+}
+
+/**
+ * @brief Frees a restart, releasing the snapshot it holds
+ * 
+ * @param rs the restart
+ */
+void journalFreeRestart(struct journalRestart *rs) {
+  if (rs->rows) editorReleaseSnapshot(rs->rows);
+  free(rs->payload.b);
+  free(rs);
+}
+
+/**
+ * @brief Asks the writer to start the journal file over
+ * 
+ * Everything still pending is dropped: it happened before the restart, so
+ * the restart already accounts for it. A restart the writer has not picked
+ * up yet is superseded.
+ * 
+ * @param j the journal
+ * @param header the header of the new journal
+ * @param rows a snapshot to store in full, NULL for none
+ * @param payload records to carry over, emptied
+ */
+void journalRequestRestart(struct journal *j, unsigned char *header,
+                           struct rowNode *rows, struct journalBuf *payload) {
+  struct journalRestart *rs = calloc(1, sizeof(*rs));
+  if (rs == NULL) die("calloc");
+  memcpy(rs->header, header, sizeof(rs->header));
+  rs->rows = rows;
+  if (payload) {
+    rs->payload = *payload;
+    memset(payload, 0, sizeof(*payload));
+  }
+
+  pthread_mutex_lock(&j->lock);
+  j->pending.len = 0;
+  struct journalRestart *old = j->restart;
+  j->restart = rs;
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+
+  if (old) {
+    if (old->rows) j->compacting = 0;
+    journalFreeRestart(old);
+  }
+  if (rows) j->compacting = 1;
+  j->created = 1;
+  j->bytes = 0;
+}
+
+/**
+ * @brief Starts journaling the buffer
+ * 
+ * @param path the journal path, owned by the journal from now on
+ * @param base the header naming the file contents the journal applies to
+ * @param fd an existing journal to keep appending to, or -1
+ */
+void editorJournalStart(char *path, unsigned char *base, int fd) {
+  struct journal *j = calloc(1, sizeof(*j));
+  if (j == NULL) die("calloc");
+  j->path = path;
+  j->fd = fd;
+  j->created = (fd != -1);
+  memcpy(j->base, base, sizeof(j->base));
+  j->limit = journalLimit(E.disk_valid ? E.disk.st_size : 0);
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->cond, NULL);
+
+  // Leave signals such as SIGWINCH to the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&j->thread, NULL, editorJournalThread, j);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (err != 0) {
+    if (fd != -1) close(fd);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j->path);
+    free(j);
+    return;
+  }
+  E.journal = j;
+}
+
+/**
+ * @brief Stops journaling
+ * 
+ * Waits for the writer to flush what is pending.
+ * 
+ * @param discard whether to delete the journal file, once its edits are
+ * saved or deliberately thrown away
+ */
+void editorJournalClose(int discard) {
+  struct journal *j = E.journal;
+  if (j == NULL) return;
+
+  pthread_mutex_lock(&j->lock);
+  j->stop = 1;
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+
+  while (j->finished) {
+    struct journalRestart *rs = j->finished;
+    j->finished = rs->next;
+    journalFreeRestart(rs);
+  }
+  if (j->fd != -1) close(j->fd);
+  if (discard) unlink(j->path);
+
+  pthread_cond_destroy(&j->cond);
+  pthread_mutex_destroy(&j->lock);
+  free(j->pending.b);
+  free(j->since_save.b);
+  free(j->path);
+  free(j);
+  E.journal = NULL;
+}
+
+/**
+ * @brief Records an edit in the journal
+ * 
+ * Called by every row primitive once the edit is done.
+ * 
+ * @param op the JOURNAL_* operation
+ * @param row the row index
+ * @param at the column, the new length for JOURNAL_TRUNCATE, or the number of
+ * rows for JOURNAL_INSERT_ROWS
+ * @param s the payload
+ * @param len the length of the payload, or the count for records without one
+ */
+void editorJournalRecord(int op, int row, int at, const char *s, size_t len) {
+  struct journal *j = E.journal;
+  if (j == NULL) return;
+
+  // The journal file is created by the first edit
+  if (!j->created) journalRequestRestart(j, j->base, NULL, NULL);
+
+  pthread_mutex_lock(&j->lock);
+  size_t before = j->pending.len;
+  journalBufPutRecord(&j->pending, op, row, at, s, len);
+  size_t n = j->pending.len - before;
+  if (before == 0) pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+
+  if (j->recording) journalBufPutRecord(&j->since_save, op, row, at, s, len);
+  j->bytes += n;
+}
+
+/**
+ * @brief Collects finished restarts and compacts an oversized journal
+ * 
+ * Polled from editorPollEvents() while the editor is idle. Compacting stores
+ * a snapshot of the whole buffer, so replaying stays proportional to the
+ * text rather than to the number of edits.
+ */
+void editorJournalPoll(void) {
+  struct journal *j = E.journal;
+  if (j == NULL) return;
+
+  pthread_mutex_lock(&j->lock);
+  struct journalRestart *done = j->finished;
+  j->finished = NULL;
+  int err = j->err;
+  j->err = 0;
+  pthread_mutex_unlock(&j->lock);
+
+  while (done) {
+    struct journalRestart *rs = done;
+    done = rs->next;
+    if (rs->rows) j->compacting = 0;
+    journalFreeRestart(rs);
+  }
+  if (err) editorSetStatusMessage("Journal write failed: %s", strerror(err));
+
+  if (!j->compacting && (off_t)j->bytes > j->limit) {
+    j->limit = journalLimit(editorRowsLength());
+    unsigned char header[32];
+    journalHeader(header, NULL);
+    journalRequestRestart(j, header, editorTakeSnapshot(), NULL);
+  }
+}
+
+/**
+ * @brief Starts copying the records made while a save is running
+ * 
+ * Called by editorSave() right after it took its snapshot. A buffer that was
+ * never journaled, because it had no file name yet, starts its journal here
+ * with a full copy of the text.
+ */
+void editorJournalSaveStarted(void) {
+  if (E.journal == NULL) {
+    unsigned char header[32];
+    journalHeader(header, NULL);
+    editorJournalStart(editorJournalPath(E.filename), header, -1);
+    if (E.journal == NULL) return;
+
+    journalRequestRestart(E.journal, header, editorTakeSnapshot(), NULL);
+  }
+  E.journal->recording = 1;
+  E.journal->since_save.len = 0;
+}
+
+/**
+ * @brief Starts the journal over once a save has finished
+ * 
+ * After a successful save the journal only needs the edits made while it
+ * was running, on top of the file that was just written.
+ * 
+ * @param ok whether the save succeeded
+ * @param st the stat of the saved file
+ * @param len the size of the saved file
+ */
+void editorJournalSaveFinished(int ok, struct stat *st, off_t len) {
+  struct journal *j = E.journal;
+  if (j == NULL) return;
+  j->recording = 0;
+  if (!ok) {
+    j->since_save.len = 0;
+    return;
+  }
+
+  journalHeader(j->base, st);
+  j->limit = journalLimit(len);
+  journalRequestRestart(j, j->base, NULL, &j->since_save);
+}
+
+/**
+ * @brief Checks that a row blob holds exactly n rows
+ * 
+ * @param s the blob
+ * @param len the length of the blob
+ * @param n the number of rows it should hold
+ */
+int journalBlobValid(const char *s, uint64_t len, uint64_t n) {
+  uint64_t off = 0;
+  for (uint64_t i = 0; i < n; i++) {
+    int rlen;
+    if (len - off < sizeof(int)) return 0;
+    memcpy(&rlen, s + off, sizeof(int));
+    off += sizeof(int);
+    if (rlen < 0 || len - off < (uint64_t)rlen) return 0;
+    off += rlen;
+  }
+  return off == len;
+}
+
+/** @struct journalShadow
+ *  @brief The row lengths journal records are checked against before they
+ * are applied
+ * 
+ *  Replay mirrors every record into the shadow first and only applies a
+ * frame to the buffer once all of its records fit, so a frame is recovered
+ * whole or not at all.
+ * 
+ *  @var foreignstruct::size
+ *  Member 'size' the length of every row
+ * 
+ *  @var foreignstruct::numrows
+ *  Member 'numrows' the number of rows
+ * 
+ *  @var foreignstruct::cap
+ *  Member 'cap' the allocated length of size
+ */
+struct journalShadow {
+  int *size;
+  int numrows;
+  int cap;
+};
+
+/**
+ * @brief Opens a gap of n rows in a shadow
+ * 
+ * @param sh the shadow
+ * @param at the index of the first new row
+ * @param n the number of rows
+ */
+void journalShadowInsert(struct journalShadow *sh, int at, int n) {
+  if (sh->numrows + n > sh->cap) {
+    sh->cap = (sh->numrows + n) * 2;
+    sh->size = realloc(sh->size, sizeof(int) * sh->cap);
+    if (sh->size == NULL) die("realloc");
+  }
+  memmove(&sh->size[at + n], &sh->size[at],
+          sizeof(int) * (sh->numrows - at));
+  sh->numrows += n;
+}
+
+/**
+ * @brief Removes n rows from a shadow
+ * 
+ * @param sh the shadow
+ * @param at the index of the first row
+ * @param n the number of rows
+ */
+void journalShadowDelete(struct journalShadow *sh, int at, int n) {
+  memmove(&sh->size[at], &sh->size[at + n],
+          sizeof(int) * (sh->numrows - at - n));
+  sh->numrows -= n;
+}
+
+/**
+ * @brief Checks that a journal record fits the rows and mirrors it into the
+ * shadow
+ * 
+ * Returns -1 on a record that does not fit, after which the shadow no longer
+ * follows the buffer.
+ * 
+ * @param sh the shadow
+ * @param op the JOURNAL_* operation
+ * @param row the row index
+ * @param at the column, the new length for JOURNAL_TRUNCATE, or the number of
+ * rows for JOURNAL_INSERT_ROWS
+ * @param s the payload
+ * @param len the length of the payload, or the count for records without one
+ */
+int journalShadowApply(struct journalShadow *sh, int op, uint64_t row,
+                       uint64_t at, const char *s, uint64_t len) {
+  uint64_t numrows = sh->numrows;
+  switch (op) {
+    case JOURNAL_RESET:
+      sh->numrows = 0;
+      return 0;
+    case JOURNAL_INSERT_ROW:
+      if (row > numrows || numrows == INT_MAX || len > INT_MAX) return -1;
+      journalShadowInsert(sh, row, 1);
+      sh->size[row] = len;
+      return 0;
+    case JOURNAL_INSERT_ROWS: {
+      if (row > numrows || at == 0 || at > INT_MAX - numrows ||
+          !journalBlobValid(s, len, at))
+        return -1;
+      journalShadowInsert(sh, row, at);
+      size_t off = 0;
+      for (uint64_t i = 0; i < at; i++) {
+        memcpy(&sh->size[row + i], s + off, sizeof(int));
+        off += sizeof(int) + sh->size[row + i];
+      }
+      return 0;
+    }
+    case JOURNAL_DEL_ROWS:
+      if (row > numrows || len == 0 || len > numrows - row) return -1;
+      journalShadowDelete(sh, row, len);
+      return 0;
+  }
+
+  if (row >= numrows) return -1;
+  uint64_t size = sh->size[row];
+  switch (op) {
+    case JOURNAL_DEL_ROW:
+      journalShadowDelete(sh, row, 1);
+      return 0;
+    case JOURNAL_INSERT_CHAR:
+      if (len != 1 || at > size) return -1;
+      size++;
+      break;
+    case JOURNAL_DEL_CHAR:
+      if (at >= size) return -1;
+      size--;
+      break;
+    case JOURNAL_APPEND:
+      size += len;
+      break;
+    case JOURNAL_TRUNCATE:
+      if (at > size) return -1;
+      size = at;
+      break;
+    case JOURNAL_INSERT_STRING:
+      if (at > size) return -1;
+      size += len;
+      break;
+    case JOURNAL_DEL_RANGE:
+      if (at > size || len > size - at) return -1;
+      size -= len;
+      break;
+    case JOURNAL_SET_ROW:
+      size = len;
+      break;
+    default:
+      return -1;
+  }
+  if (size > INT_MAX) return -1;
+  sh->size[row] = size;
+  return 0;
+}
+
+/**
+ * @brief Applies one journal record to the buffer
+ * 
+ * The record must have been checked by journalShadowApply().
+ * 
+ * @param op the JOURNAL_* operation
+ * @param row the row index
+ * @param at the column, the new length for JOURNAL_TRUNCATE, or the number of
+ * rows for JOURNAL_INSERT_ROWS
+ * @param s the payload
+ * @param len the length of the payload, or the count for records without one
+ */
+void editorJournalApply(int op, uint64_t row, uint64_t at, char *s,
+                        uint64_t len) {
+  erow *r = row < (uint64_t)E.numrows ? &E.row[row] : NULL;
+  switch (op) {
+    case JOURNAL_RESET:
+      editorFreeBuffer();
+      break;
+    case JOURNAL_INSERT_ROW:
+      editorInsertRow(row, s, len);
+      break;
+    case JOURNAL_INSERT_ROWS:
+      editorInsertRows(row, at, s);
+      break;
+    case JOURNAL_DEL_ROWS:
+      editorDelRows(row, len);
+      break;
+    case JOURNAL_DEL_ROW:
+      editorDelRow(row);
+      break;
+    case JOURNAL_INSERT_CHAR:
+      editorRowInsertChar(r, at, (unsigned char)s[0]);
+      break;
+    case JOURNAL_DEL_CHAR:
+      editorRowDelChar(r, at);
+      break;
+    case JOURNAL_APPEND:
+      editorRowAppendString(r, s, len);
+      break;
+    case JOURNAL_TRUNCATE:
+      editorRowTruncate(r, at);
+      break;
+    case JOURNAL_INSERT_STRING:
+      editorRowInsertString(r, at, s, len);
+      break;
+    case JOURNAL_DEL_RANGE:
+      editorRowDelRange(r, at, len);
+      break;
+    case JOURNAL_SET_ROW:
+      editorRowSet(r, s, len);
+      break;
+  }
+}
+
+/**
+ * @brief Checks or applies the records of one journal frame
+ * 
+ * Returns the number of records, or -1 if the frame is malformed or, when
+ * checking, a record does not fit the shadow.
+ * 
+ * @param sh the shadow to check the records against
+ * @param frame the frame
+ * @param len the length of the frame
+ * @param apply 0 to check the records, 1 to apply checked ones to the buffer
+ */
+int journalReplayFrame(struct journalShadow *sh, char *frame, uint64_t len,
+                       int apply) {
+  const unsigned char *p = (const unsigned char *)frame;
+  const unsigned char *end = p + len;
+  int n = 0;
+  while (p < end) {
+    int op = *p++;
+    uint64_t row, at, rlen;
+    if (journalGetVarint(&p, end, &row) == -1 ||
+        journalGetVarint(&p, end, &at) == -1 ||
+        journalGetVarint(&p, end, &rlen) == -1)
+      return -1;
+    uint64_t plen = journalHasPayload(op) ? rlen : 0;
+    if ((uint64_t)(end - p) < plen) return -1;
+    if (apply)
+      editorJournalApply(op, row, at, (char *)p, rlen);
+    else if (journalShadowApply(sh, op, row, at, (const char *)p, rlen) == -1)
+      return -1;
+    p += plen;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @brief Replays a journal on top of the freshly opened file
+ * 
+ * Frames are applied in order up to the first one that is incomplete, fails
+ * its checksum or does not fit the buffer, which is where a crash
+ * interrupted the writer. Each frame is checked whole before any of its
+ * records is applied. Returns the number of records applied, or -1 if the
+ * journal belongs to different file contents.
+ * 
+ * @param fd the journal file
+ * @param base the header the journal must carry
+ * @param valid set to the length of the intact part of the journal
+ */
+int editorJournalReplay(int fd, unsigned char *base, off_t *valid) {
+  struct stat st;
+  if (fstat(fd, &st) == -1) return -1;
+  char *data = malloc(st.st_size ? st.st_size : 1);
+  if (data == NULL) die("malloc");
+  off_t size = 0;
+  while (size < st.st_size) {
+    ssize_t n = pread(fd, data + size, st.st_size - size, size);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    size += n;
+  }
+
+  const unsigned char *u = (const unsigned char *)data;
+  if (size < 32 || memcmp(u, "KILOJNL1", 8) != 0) {
+    free(data);
+    return -1;
+  }
+
+  struct journalShadow sh;
+  sh.numrows = 0;
+  sh.cap = E.numrows + 16;
+  sh.size = malloc(sizeof(int) * sh.cap);
+  if (sh.size == NULL) die("malloc");
+  journalShadowInsert(&sh, 0, E.numrows);
+  for (int j = 0; j < E.numrows; j++) sh.size[j] = E.row[j].size;
+
+  off_t off = 32;
+  int applied = 0;
+  while (off + 8 <= size) {
+    uint64_t len = journalGetLE(u + off, 4);
+    if ((uint64_t)(size - off - 8) < len) break;
+    char *frame = data + off + 8;
+    if (journalChecksum(frame, len) != journalGetLE(u + off + 4, 4)) break;
+
+    // A journal that was compacted carries the whole text and does not
+    // depend on the file
+    if (applied == 0 && memcmp(u + 8, base + 8, 24) != 0 &&
+        !(len > 0 && frame[0] == JOURNAL_RESET)) {
+      free(sh.size);
+      free(data);
+      return -1;
+    }
+
+    if (journalReplayFrame(&sh, frame, len, 0) == -1) break;
+    applied += journalReplayFrame(&sh, frame, len, 1);
+    off += 8 + len;
+  }
+
+  free(sh.size);
+  free(data);
+  *valid = off;
+  return applied;
+}
+
+/**
+ * @brief Recovers unsaved edits left by a crash and starts journaling
+ * 
+ * Called by editorOpen() once the file is loaded. A journal that does not
+ * match the file is moved aside rather than replayed or overwritten.
+ */
+void editorJournalOpen(void) {
+  if (E.filename == NULL) return;
+  char *path = editorJournalPath(E.filename);
+  unsigned char base[32];
+  journalHeader(base, E.disk_valid ? &E.disk : NULL);
+
+  off_t valid = 0;
+  int rewrite = 0;
+  int fd = open(path, O_RDWR);
+  if (fd != -1) {
+    int n = editorJournalReplay(fd, base, &valid);
+    if (n > 0) {
+      E.dirty = n;
+      editorSetStatusMessage("Recovered unsaved edits from %s", path);
+
+      // The journal holds the only copy of those edits: if it cannot be cut
+      // back to its intact part, keep it until a full copy of the text
+      // replaces it
+      if (ftruncate(fd, valid) == -1 || lseek(fd, valid, SEEK_SET) == -1) {
+        close(fd);
+        fd = -1;
+        rewrite = 1;
+      }
+    } else if (n == -1) {
+      size_t len = strlen(path) + 5;
+      char *aside = malloc(len);
+      if (aside == NULL) die("malloc");
+      snprintf(aside, len, "%s.old", path);
+      rename(path, aside);
+      editorSetStatusMessage("Journal does not match the file, moved to %s",
+                             aside);
+      free(aside);
+      close(fd);
+      fd = -1;
+    } else {
+      unlink(path);
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  editorJournalStart(path, base, fd);
+  if (E.journal && fd != -1) E.journal->bytes = valid;
+  if (E.journal && rewrite) {
+    unsigned char header[32];
+    journalHeader(header, NULL);
+    journalRequestRestart(E.journal, header, editorTakeSnapshot(), NULL);
+  }
+}
+
+/*** undo ***/
+
+/**
+ * @brief Rounds a payload length up to keep the next record int aligned
+ * 
+ * @param len the payload length
+ */
+size_t undoPad(size_t len) {
+  return (len + sizeof(int) - 1) & ~(sizeof(int) - 1);
+}
+
+/**
+ * @brief Makes room for n more bytes on an undo stack
+ * 
+ * @param st the stack
+ * @param n the number of bytes
+ */
+void undoReserve(struct undoStack *st, size_t n) {
+  if (st->len + n <= st->cap) return;
+  size_t cap = st->cap ? st->cap * 2 : 4096;
+  while (cap < st->len + n) cap *= 2;
+  st->b = realloc(st->b, cap);
+  if (st->b == NULL) die("realloc");
+  st->cap = cap;
+}
+
+/**
+ * @brief Returns the record at an offset of an undo stack
+ * 
+ * @param st the stack
+ * @param off the offset of the record
+ */
+struct undoRecord *undoAt(struct undoStack *st, size_t off) {
+  return (struct undoRecord *)(st->b + off);
+}
+
+/**
+ * @brief Returns the size of the record on top of an undo stack
+ * 
+ * @param st the stack, which must not be empty
+ */
+size_t undoTopSize(struct undoStack *st) {
+  int size;
+  memcpy(&size, st->b + st->len - sizeof(int), sizeof(int));
+  return size;
+}
+
+/**
+ * @brief Writes the header and trailer of a record whose payload is in place
+ * 
+ * @param st the stack
+ * @param off the offset of the record, which becomes the top of the stack
+ * @param op the UNDO_* operation
+ * @param row the row
+ * @param at the column or row count
+ * @param len the payload length
+ */
+void undoSeal(struct undoStack *st, size_t off, int op, int row, int at,
+              size_t len) {
+  struct undoRecord *rec = undoAt(st, off);
+  rec->op = op;
+  rec->row = row;
+  rec->at = at;
+  rec->len = len;
+  int size = sizeof(struct undoRecord) + undoPad(len) + sizeof(int);
+  memcpy(st->b + off + size - sizeof(int), &size, sizeof(int));
+  st->len = off + size;
+}
+
+/**
+ * @brief Pushes a new record onto the undo history of the open group
+ * 
+ * The group's UNDO_GROUP record is written before its first edit, and any
+ * redo history is forgotten at that point. Returns where the payload goes.
+ * 
+ * @param op the UNDO_* operation
+ * @param row the row
+ * @param at the column or row count
+ * @param len the payload length
+ */
+char *undoPush(int op, int row, int at, size_t len) {
+  struct undoState *u = &E.undo;
+  size_t need = sizeof(struct undoRecord) + undoPad(len) + sizeof(int);
+
+  if (u->group == UNDO_NOREC) {
+    u->redo.len = 0;
+    size_t gsize = sizeof(struct undoRecord) + 2 * sizeof(int) + sizeof(int);
+    undoReserve(&u->undo, gsize);
+    u->group = u->undo.len;
+    int after[2] = {u->cy, u->cx};
+    memcpy(u->undo.b + u->group + sizeof(struct undoRecord), after,
+           sizeof(after));
+    undoSeal(&u->undo, u->group, UNDO_GROUP, u->cy, u->cx, sizeof(after));
+  }
+
+  undoReserve(&u->undo, need);
+  u->last = u->undo.len;
+  undoSeal(&u->undo, u->last, op, row, at, len);
+  return u->undo.b + u->last + sizeof(struct undoRecord);
+}
+
+/**
+ * @brief Opens a gap in the payload of the open group's last record
+ * 
+ * Returns where the gap starts.
+ * 
+ * @param pos the offset in the payload to open the gap at
+ * @param n the size of the gap
+ */
+char *undoGrow(size_t pos, size_t n) {
+  struct undoState *u = &E.undo;
+  struct undoRecord rec = *undoAt(&u->undo, u->last);
+  size_t len = rec.len + n;
+  undoReserve(&u->undo, undoPad(len) - undoPad(rec.len));
+
+  char *payload = u->undo.b + u->last + sizeof(struct undoRecord);
+  memmove(payload + pos + n, payload + pos, rec.len - pos);
+  undoSeal(&u->undo, u->last, rec.op, rec.row, rec.at, len);
+  return payload + pos;
+}
+
+/**
+ * @brief Returns the last record of the open group, NULL if it has none
+ */
+struct undoRecord *undoLast(void) {
+  if (E.undo.last == UNDO_NOREC) return NULL;
+  return undoAt(&E.undo.undo, E.undo.last);
+}
+
+/**
+ * @brief Checks whether edits are being recorded right now
+ * 
+ * Only edits made by keys that opened a group are, so loading a file or
+ * replaying the journal or the undo history itself leaves no trace.
+ */
+int undoRecording(void) {
+  return E.undo.kind != UNDO_KIND_NONE && !E.undo.dropped;
+}
+
+/**
+ * @brief Keeps the undo history within its budget
+ * 
+ * Whole groups are dropped from the bottom until half the budget is left,
+ * so the memmove is paid for by the edits that filled the other half. A
+ * group that does not fit the budget on its own stops being recorded and
+ * takes the older history with it.
+ */
+void undoTrim(void) {
+  struct undoState *u = &E.undo;
+  if (u->undo.len <= u->budget) return;
+
+  if (u->undo.len - u->group > u->budget) {
+    u->undo.len = 0;
+    u->group = UNDO_NOREC;
+    u->last = UNDO_NOREC;
+    u->dropped = 1;
+    editorSetStatusMessage("Edit too large to undo");
+    return;
+  }
+
+  size_t cut = 0;
+  while (cut < u->group) {
+    struct undoRecord *rec = undoAt(&u->undo, cut);
+    if (rec->op == UNDO_GROUP && u->undo.len - cut <= u->budget / 2) break;
+    cut += sizeof(struct undoRecord) + undoPad(rec->len) + sizeof(int);
+  }
+  memmove(u->undo.b, u->undo.b + cut, u->undo.len - cut);
+  u->undo.len -= cut;
+  u->group -= cut;
+  u->last -= cut;
+}
+
+/**
+ * @brief Records text inserted into a row
+ * 
+ * @param row the row index
+ * @param at the column the text was inserted at
+ * @param s the text
+ * @param len the length of the text
+ */
+void editorUndoInsert(int row, int at, const char *s, size_t len) {
+  if (!undoRecording() || len == 0) return;
+  struct undoRecord *last = undoLast();
+
+  if (last && last->op == UNDO_INSERT && last->row == row &&
+      last->at + last->len == at) {
+    memcpy(undoGrow(last->len, len), s, len);
+  } else if (last && last->op == UNDO_INSERT_ROWS &&
+             row == last->row + last->at - 1) {
+    // Typing into the last row this group inserted extends that row
+    char *lenp = E.undo.undo.b + E.undo.last + sizeof(struct undoRecord) +
+                 E.undo.lastrow;
+    int rowlen;
+    memcpy(&rowlen, lenp, sizeof(int));
+    if (at > rowlen) {
+      memcpy(undoPush(UNDO_INSERT, row, at, len), s, len);
+    } else {
+      memcpy(undoGrow(E.undo.lastrow + sizeof(int) + at, len), s, len);
+      rowlen += len;
+      memcpy(E.undo.undo.b + E.undo.last + sizeof(struct undoRecord) +
+             E.undo.lastrow, &rowlen, sizeof(int));
+    }
+  } else {
+    memcpy(undoPush(UNDO_INSERT, row, at, len), s, len);
+  }
+  undoTrim();
+}
+
+/**
+ * @brief Records text about to be deleted from a row
+ * 
+ * @param row the row index
+ * @param at the column of the first deleted char
+ * @param s the text
+ * @param len the length of the text
+ */
+void editorUndoDelete(int row, int at, const char *s, size_t len) {
+  if (!undoRecording() || len == 0) return;
+  struct undoRecord *last = undoLast();
+
+  if (last && last->op == UNDO_DELETE && last->row == row &&
+      last->at == at) {
+    memcpy(undoGrow(last->len, len), s, len);
+  } else if (last && last->op == UNDO_DELETE && last->row == row &&
+             at + (int)len == last->at) {
+    // Backspacing over a line grows the deleted text at the front
+    memcpy(undoGrow(0, len), s, len);
+    undoLast()->at = at;
+  } else {
+    memcpy(undoPush(UNDO_DELETE, row, at, len), s, len);
+  }
+  undoTrim();
+}
+
+/**
+ * @brief Returns the size of rows stored as a row blob
+ * 
+ * @param at the first row
+ * @param n the number of rows
+ */
+size_t undoBlobSize(int at, int n) {
+  size_t len = 0;
+  for (int i = 0; i < n; i++) len += sizeof(int) + E.rowsize[at + i];
+  return len;
+}
+
+/**
+ * @brief Stores rows as a row blob, each preceded by its length
+ * 
+ * Returns the offset of the last row in the blob.
+ * 
+ * @param p where to store the blob
+ * @param at the first row
+ * @param n the number of rows
+ */
+size_t undoBlobFill(char *p, int at, int n) {
+  char *start = p, *lastrow = p;
+  for (int i = 0; i < n; i++) {
+    erow *row = &E.row[at + i];
+    lastrow = p;
+    memcpy(p, &row->size, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, row->chars, row->size);
+    p += row->size;
+  }
+  return lastrow - start;
+}
+
+/**
+ * @brief Records rows that were just inserted
+ * 
+ * @param at the index of the first new row
+ * @param n the number of rows
+ */
+void editorUndoInsertRows(int at, int n) {
+  if (!undoRecording()) return;
+  struct undoRecord *last = undoLast();
+  size_t len = undoBlobSize(at, n);
+
+  if (last && last->op == UNDO_INSERT_ROWS && at == last->row + last->at) {
+    size_t old = last->len;
+    E.undo.lastrow = old + undoBlobFill(undoGrow(old, len), at, n);
+    undoLast()->at += n;
+  } else {
+    E.undo.lastrow = undoBlobFill(undoPush(UNDO_INSERT_ROWS, at, n, len), at, n);
+  }
+  undoTrim();
+}
+
+/**
+ * @brief Records rows that are about to be deleted
+ * 
+ * @param at the index of the first row
+ * @param n the number of rows
+ */
+void editorUndoDeleteRows(int at, int n) {
+  if (!undoRecording()) return;
+  struct undoRecord *last = undoLast();
+  size_t len = undoBlobSize(at, n);
+
+  if (last && last->op == UNDO_DELETE_ROWS && at == last->row) {
+    undoBlobFill(undoGrow(last->len, len), at, n);
+    undoLast()->at += n;
+  } else if (last && last->op == UNDO_DELETE_ROWS && at + n == last->row) {
+    undoBlobFill(undoGrow(0, len), at, n);
+    last = undoLast();
+    last->row = at;
+    last->at += n;
+  } else {
+    undoBlobFill(undoPush(UNDO_DELETE_ROWS, at, n, len), at, n);
+  }
+  undoTrim();
+}
+
+/**
+ * @brief Closes the open undo group
+ */
+void editorUndoClose(void) {
+  struct undoState *u = &E.undo;
+  u->kind = UNDO_KIND_NONE;
+  u->group = UNDO_NOREC;
+  u->last = UNDO_NOREC;
+  u->dropped = 0;
+}
+
+/**
+ * @brief Starts the undo group for an editing operation, or keeps extending
+ * the open one
+ * 
+ * Operations of the same kind that pick up where the previous one left the
+ * cursor, without a pause of more than KILO_UNDO_COALESCE_MS, are undone
+ * together, so a burst of typing or a paste is a single step. Moving the
+ * cursor in between starts a new group.
+ * 
+ * @param kind the UNDO_KIND_* of the operation
+ */
+void editorUndoBegin(int kind) {
+  struct undoState *u = &E.undo;
+  if (kind == u->kind && E.cx == u->ex && E.cy == u->ey &&
+      editorNowNs() - u->time < KILO_UNDO_COALESCE_MS * 1000000LL)
+    return;
+
+  editorUndoClose();
+  u->kind = kind;
+  u->cx = E.cx;
+  u->cy = E.cy;
+}
+
+/**
+ * @brief Notes where an editing operation left the cursor
+ * 
+ * The group remembers it for redo, and the next operation checks it before
+ * joining the group.
+ */
+void editorUndoEnd(void) {
+  struct undoState *u = &E.undo;
+  u->ex = E.cx;
+  u->ey = E.cy;
+  u->time = editorNowNs();
+  if (u->group != UNDO_NOREC) {
+    int after[2] = {E.cy, E.cx};
+    memcpy(u->undo.b + u->group + sizeof(struct undoRecord), after,
+           sizeof(after));
+  }
+}
+
+/**
+ * @brief Forgets all undo and redo history
+ * 
+ * Called whenever the buffer is replaced wholesale.
+ */
+void editorUndoReset(void) {
+  editorUndoClose();
+  E.undo.undo.len = 0;
+  E.undo.redo.len = 0;
+}
+
+/**
+ * @brief Applies an undo record forwards or backwards
+ * 
+ * @param rec the record
+ * @param reverse 1 to undo the record, 0 to redo it
+ */
+void undoApply(struct undoRecord *rec, int reverse) {
+  char *p = (char *)(rec + 1);
+  int op = rec->op;
+  if (reverse) {
+    if (op == UNDO_INSERT) op = UNDO_DELETE;
+    else if (op == UNDO_DELETE) op = UNDO_INSERT;
+    else if (op == UNDO_INSERT_ROWS) op = UNDO_DELETE_ROWS;
+    else if (op == UNDO_DELETE_ROWS) op = UNDO_INSERT_ROWS;
+  }
+
+  switch (op) {
+    case UNDO_INSERT:
+      editorRowInsertString(&E.row[rec->row], rec->at, p, rec->len);
+      break;
+    case UNDO_DELETE:
+      editorRowDelRange(&E.row[rec->row], rec->at, rec->len);
+      break;
+    case UNDO_INSERT_ROWS:
+      editorInsertRows(rec->row, rec->at, p);
+      break;
+    case UNDO_DELETE_ROWS:
+      editorDelRows(rec->row, rec->at);
+      break;
+  }
+}
+
+/**
+ * @brief Moves the record on top of one undo stack onto another
+ * 
+ * @param from the stack to pop from
+ * @param to the stack to push onto
+ */
+void undoMoveTop(struct undoStack *from, struct undoStack *to) {
+  size_t size = undoTopSize(from);
+  undoReserve(to, size);
+  memcpy(to->b + to->len, from->b + from->len - size, size);
+  to->len += size;
+  from->len -= size;
+}
+
+/**
+ * @brief Places the cursor after an undo or redo, inside the buffer
+ * 
+ * @param cy the cursor row
+ * @param cx the cursor column
+ */
+void undoSetCursor(int cy, int cx) {
+  if (cy > E.numrows) cy = E.numrows;
+  if (cy < 0) cy = 0;
+  int size = cy < E.numrows ? E.row[cy].size : 0;
+  if (cx > size) cx = size;
+  if (cx < 0) cx = 0;
+  E.cy = cy;
+  E.cx = cx;
+}
+
+/**
+ * @brief Undoes the most recent group of edits
+ * 
+ * Each record is reverted in O(its size), however many keystrokes went into
+ * it.
+ */
+void editorUndo(void) {
+  struct undoState *u = &E.undo;
+  editorUndoClose();
+  if (u->undo.len == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+
+  for (;;) {
+    struct undoRecord *rec = undoAt(&u->undo, u->undo.len - undoTopSize(&u->undo));
+    if (rec->op == UNDO_GROUP) {
+      undoSetCursor(rec->row, rec->at);
+      undoMoveTop(&u->undo, &u->redo);
+      break;
+    }
+    undoApply(rec, 1);
+    undoMoveTop(&u->undo, &u->redo);
+  }
+}
+
+/**
+ * @brief Redoes the most recently undone group of edits
+ */
+void editorRedo(void) {
+  struct undoState *u = &E.undo;
+  editorUndoClose();
+  if (u->redo.len == 0) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+
+  struct undoRecord *group = undoAt(&u->redo, u->redo.len - undoTopSize(&u->redo));
+  int after[2];
+  memcpy(after, group + 1, sizeof(after));
+  undoMoveTop(&u->redo, &u->undo);
+
+  while (u->redo.len > 0) {
+    struct undoRecord *rec = undoAt(&u->redo, u->redo.len - undoTopSize(&u->redo));
+    if (rec->op == UNDO_GROUP) break;
+    undoApply(rec, 0);
+    undoMoveTop(&u->redo, &u->undo);
+  }
+  undoSetCursor(after[0], after[1]);
+}
+
+/*** regex ***/
+
+/** @struct reNode
+ *  @brief An instruction of a compiled regular expression
+ * 
+ *  The expression compiles to a Thompson NFA: RE_SET consumes one byte that
+ * is in set, RE_SPLIT continues at both out and out1 without consuming
+ * anything, RE_BOL and RE_EOL continue at out only at the start and the end
+ * of the row, and RE_MATCH accepts.
+ */
+struct reNode {
+  int op;
+  int out;
+  int out1;
+  unsigned char set[32];
+};
+
+/** @struct reAst
+ *  @brief A node of the parse tree a regular expression is compiled from
+ * 
+ *  @var foreignstruct::min
+ *  Member 'min' the fewest repetitions of an RE_REPEAT
+ * 
+ *  @var foreignstruct::max
+ *  Member 'max' the most repetitions of an RE_REPEAT, -1 for no limit
+ */
+struct reAst {
+  int op;
+  int left;
+  int right;
+  int min;
+  int max;
+  unsigned char set[32];
+};
+
+/** @struct reParser
+ *  @brief The state of parsing a regular expression
+ */
+struct reParser {
+  const char *p;
+  int icase;
+  struct reAst *ast;
+  int n;
+  int cap;
+};
+
+/** @struct dfaState
+ *  @brief A state of the lazily built DFA: a set of NFA instructions
+ * 
+ *  @var foreignstruct::nodes
+ *  Member 'nodes' the RE_SET, RE_EOL and RE_MATCH instructions in the set,
+ * sorted
+ * 
+ *  @var foreignstruct::match
+ *  Member 'match' whether the set holds RE_MATCH, so a match ends here
+ * 
+ *  @var foreignstruct::eolmatch
+ *  Member 'eolmatch' whether a match ends here if this is the end of the row
+ */
+struct dfaState {
+  int *nodes;
+  int n;
+  int match;
+  int eolmatch;
+};
+
+/** @struct regexDfa
+ *  @brief A cache of DFA states for one regex, private to one thread
+ * 
+ *  States are built the first time a byte leads to them, so scanning a row
+ * costs one table lookup per byte once the cache is warm, whatever the
+ * expression. When the cache fills up it is thrown away and started over,
+ * which bounds its memory without giving up the linear running time.
+ * 
+ *  @var foreignstruct::id
+ *  Member 'id' the regex the states belong to
+ * 
+ *  @var foreignstruct::trans
+ *  Member 'trans' 256 entries per state: the state reached on each byte
+ * times 256, -1 until it is first needed, or for states the scan has to
+ * stop at, -2 minus the state
+ * 
+ *  @var foreignstruct::start
+ *  Member 'start' the state at the start of a row
+ * 
+ *  @var foreignstruct::restart
+ *  Member 'restart' the state where no match has begun yet past the start
+ * of the row, the same as start unless the regex uses ^
+ * 
+ *  @var foreignstruct::accel
+ *  Member 'accel' the bytes that leave the restart state, when there are few
+ * enough of them to skip ahead to with a vector compare
+ * 
+ *  @var foreignstruct::table
+ *  Member 'table' a hash table of state indexes, -1 for empty slots
+ * 
+ *  @var foreignstruct::mark
+ *  Member 'mark' scratch space for building sets, one entry per instruction
+ */
+struct regexDfa {
+  int id;
+  struct dfaState *states;
+  int *trans;
+  int n;
+  int start;
+  int restart;
+  unsigned char accel[4];
+  int naccel;
+  int *table;
+  int *mark;
+  int *scratch;
+  int stamp;
+};
+
+/** @struct regex
+ *  @brief A compiled regular expression
+ * 
+ *  @var foreignstruct::id
+ *  Member 'id' a number no other regex compiled by this process has, which
+ * ties DFA caches to the regex they were built for
+ * 
+ *  @var foreignstruct::dfa
+ *  Member 'dfa' the DFA cache of the main thread
+ */
+struct regex {
+  struct reNode *nodes;
+  int n;
+  int start;
+  int id;
+  struct regexDfa dfa;
+};
+
+enum reOp { RE_SET = 1, RE_SPLIT, RE_MATCH, RE_BOL, RE_EOL, RE_CAT, RE_ALT,
+            RE_STAR, RE_PLUS, RE_QUEST, RE_REPEAT, RE_EMPTY };
+
+// The largest count a {m,n} interval may have, and the most instructions a
+// regex may compile to once intervals are expanded
+#define RE_REPEAT_MAX 255
+#define RE_MAX_NODES 65536
+
+/**
+ * @brief Adds a node to the parse tree
+ * 
+ * @param ps the parser
+ * @param op the kind of node
+ * @param left the first operand, -1 for none
+ * @param right the second operand, -1 for none
+ */
+int reAstNew(struct reParser *ps, int op, int left, int right) {
+  if (ps->n == ps->cap) {
+    ps->cap = ps->cap ? ps->cap * 2 : 32;
+    ps->ast = realloc(ps->ast, sizeof(*ps->ast) * ps->cap);
+    if (ps->ast == NULL) die("realloc");
+  }
+  struct reAst *a = &ps->ast[ps->n];
+  a->op = op;
+  a->left = left;
+  a->right = right;
+  a->min = a->max = 0;
+  memset(a->set, 0, sizeof(a->set));
+  return ps->n++;
+}
+
+/**
+ * @brief Adds a byte to a set, in both cases when matching ignores case
+ * 
+ * @param set the set
+ * @param c the byte
+ * @param icase whether to add the other case as well
+ */
+void reSetAdd(unsigned char *set, int c, int icase) {
+  set[c >> 3] |= 1 << (c & 7);
+  if (icase && isalpha(c)) {
+    int o = islower(c) ? toupper(c) : tolower(c);
+    set[o >> 3] |= 1 << (o & 7);
+  }
+}
+
+/**
+ * @brief Adds the bytes of a \d, \w or \s class to a set
+ * 
+ * Returns 0 if c does not name a class.
+ * 
+ * @param set the set
+ * @param c the letter after the backslash
+ */
+int reSetClass(unsigned char *set, int c) {
+  int lc = tolower(c);
+  if (lc != 'd' && lc != 'w' && lc != 's') return 0;
+  for (int b = 0; b < 256; b++) {
+    int in = lc == 'd' ? isdigit(b) : lc == 's' ? isspace(b)
+                                                : (isalnum(b) || b == '_');
+    if (!in != !islower(c)) continue;
+    set[b >> 3] |= 1 << (b & 7);
+  }
+  return 1;
+}
+
+/**
+ * @brief Adds the bytes of a POSIX character class such as [:digit:] to a set
+ * 
+ * Returns -1 if the name is not a class.
+ * 
+ * @param set the set
+ * @param name the name of the class
+ * @param len the length of the name
+ * @param icase whether to add the other case as well
+ */
+int reSetPosixClass(unsigned char *set, const char *name, int len, int icase) {
+  static const char *names[] = {
+    "alnum", "alpha", "blank", "cntrl", "digit", "graph", "lower", "print",
+    "punct", "space", "upper", "xdigit"
+  };
+  int k;
+  for (k = 0; k < 12; k++)
+    if ((int)strlen(names[k]) == len && !strncmp(names[k], name, len)) break;
+  if (k == 12) return -1;
+  for (int b = 0; b < 256; b++) {
+    int in;
+    switch (k) {
+      case 0: in = isalnum(b); break;
+      case 1: in = isalpha(b); break;
+      case 2: in = b == ' ' || b == '\t'; break;
+      case 3: in = iscntrl(b); break;
+      case 4: in = isdigit(b); break;
+      case 5: in = isgraph(b); break;
+      case 6: in = islower(b); break;
+      case 7: in = isprint(b); break;
+      case 8: in = ispunct(b); break;
+      case 9: in = isspace(b); break;
+      case 10: in = isupper(b); break;
+      default: in = isxdigit(b); break;
+    }
+    if (in) reSetAdd(set, b, icase);
+  }
+  return 0;
+}
+
+int reParseAlt(struct reParser *ps);
+
+/**
+ * @brief Parses a bracket expression such as [a-z_], [^0-9] or [[:alpha:]]
+ * 
+ * Collating symbols and equivalence classes ([. .] and [= =]) are not
+ * supported and make the expression invalid.
+ * 
+ * @param ps the parser, positioned after the '['
+ * @param set the set to fill
+ */
+int reParseBracket(struct reParser *ps, unsigned char *set) {
+  int negate = 0;
+  if (*ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  int first = 1;
+  while (*ps->p && (*ps->p != ']' || first)) {
+    first = 0;
+    if (ps->p[0] == '[' && (ps->p[1] == '.' || ps->p[1] == '=')) return -1;
+    if (ps->p[0] == '[' && ps->p[1] == ':') {
+      const char *name = ps->p + 2, *close = strstr(name, ":]");
+      if (close == NULL ||
+          reSetPosixClass(set, name, close - name, ps->icase) == -1)
+        return -1;
+      ps->p = close + 2;
+      continue;
+    }
+    int c = (unsigned char)*ps->p++;
+    if (c == '\\' && *ps->p) {
+      c = (unsigned char)*ps->p++;
+      if (reSetClass(set, c)) continue;
+    }
+    int hi = c;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+      if (hi == '\\' && *ps->p) hi = (unsigned char)*ps->p++;
+    }
+    if (hi < c) return -1;
+    for (int b = c; b <= hi; b++) reSetAdd(set, b, ps->icase);
+  }
+  if (*ps->p != ']') return -1;
+  ps->p++;
+  if (negate)
+    for (int i = 0; i < 32; i++) set[i] = ~set[i];
+  return 0;
+}
+
+/**
+ * @brief Parses one atom: a byte, a class, a bracket expression, a group or
+ * an anchor
+ * 
+ * @param ps the parser
+ */
+int reParseAtom(struct reParser *ps) {
+  int c = (unsigned char)*ps->p;
+  if (c == '(') {
+    ps->p++;
+    int a = reParseAlt(ps);
+    if (a == -1 || *ps->p != ')') return -1;
+    ps->p++;
+    return a;
+  }
+  if (c == '^' || c == '$') {
+    ps->p++;
+    return reAstNew(ps, c == '^' ? RE_BOL : RE_EOL, -1, -1);
+  }
+  if (c == '\0' || c == ')' || c == '|' || c == '*' || c == '+' ||
+      c == '?' || c == '{')
+    return -1;
+
+  ps->p++;
+  int a = reAstNew(ps, RE_SET, -1, -1);
+  unsigned char *set = ps->ast[a].set;
+  if (c == '.') {
+    memset(set, 0xff, 32);
+  } else if (c == '[') {
+    if (reParseBracket(ps, set) == -1) return -1;
+  } else if (c == '\\' && *ps->p) {
+    c = (unsigned char)*ps->p++;
+    if (!reSetClass(set, c)) reSetAdd(set, c, ps->icase);
+  } else {
+    reSetAdd(set, c, ps->icase);
+  }
+  return a;
+}
+
+/**
+ * @brief Parses a repetition count of an {m,n} interval
+ * 
+ * Returns -1 if there is no count at the parser's position.
+ * 
+ * @param ps the parser
+ */
+int reParseCount(struct reParser *ps) {
+  if (!isdigit((unsigned char)*ps->p)) return -1;
+  int n = 0;
+  while (isdigit((unsigned char)*ps->p)) {
+    n = n * 10 + (*ps->p++ - '0');
+    if (n > RE_REPEAT_MAX) return -1;
+  }
+  return n;
+}
+
+/**
+ * @brief Parses an atom followed by any number of *, +, ? and {m,n}
+ * operators
+ * 
+ * @param ps the parser
+ */
+int reParseRepeat(struct reParser *ps) {
+  int a = reParseAtom(ps);
+  while (a != -1) {
+    int op = *ps->p == '*' ? RE_STAR : *ps->p == '+' ? RE_PLUS
+           : *ps->p == '?' ? RE_QUEST : *ps->p == '{' ? RE_REPEAT : 0;
+    if (op == 0) break;
+    ps->p++;
+    if (op != RE_REPEAT) {
+      a = reAstNew(ps, op, a, -1);
+      continue;
+    }
+
+    // {m}, {m,} or {m,n}
+    int min = reParseCount(ps), max = min;
+    if (min == -1) return -1;
+    if (*ps->p == ',') {
+      ps->p++;
+      max = *ps->p == '}' ? -1 : reParseCount(ps);
+      if (max == -1 && *ps->p != '}') return -1;
+      if (max != -1 && max < min) return -1;
+    }
+    if (*ps->p != '}') return -1;
+    ps->p++;
+    a = reAstNew(ps, RE_REPEAT, a, -1);
+    ps->ast[a].min = min;
+    ps->ast[a].max = max;
+  }
+  return a;
+}
+
+/**
+ * @brief Parses a sequence of repeated atoms
+ * 
+ * @param ps the parser
+ */
+int reParseCat(struct reParser *ps) {
+  int a = reAstNew(ps, RE_EMPTY, -1, -1);
+  while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+    int b = reParseRepeat(ps);
+    if (b == -1) return -1;
+    a = reAstNew(ps, RE_CAT, a, b);
+  }
+  return a;
+}
+
+/**
+ * @brief Parses alternatives separated by |
+ * 
+ * @param ps the parser
+ */
+int reParseAlt(struct reParser *ps) {
+  int a = reParseCat(ps);
+  while (a != -1 && *ps->p == '|') {
+    ps->p++;
+    int b = reParseCat(ps);
+    if (b == -1) return -1;
+    a = reAstNew(ps, RE_ALT, a, b);
+  }
+  return a;
+}
+
+/**
+ * @brief Adds an instruction to a regex
+ * 
+ * @param re the regex
+ * @param op the instruction
+ * @param out the instruction to continue at
+ * @param out1 the other instruction to continue at, for RE_SPLIT
+ */
+int reEmit(struct regex *re, int op, int out, int out1) {
+  re->nodes = realloc(re->nodes, sizeof(*re->nodes) * (re->n + 1));
+  if (re->nodes == NULL) die("realloc");
+  struct reNode *node = &re->nodes[re->n];
+  node->op = op;
+  node->out = out;
+  node->out1 = out1;
+  return re->n++;
+}
+
+/**
+ * @brief Compiles a parse tree node into instructions
+ * 
+ * Compiling back to front, with the instruction that follows already known,
+ * saves patching dangling exits afterwards. Returns the first instruction
+ * of the node.
+ * 
+ * @param re the regex
+ * @param ps the parser holding the tree
+ * @param a the node
+ * @param next the instruction to continue at after the node
+ */
+int reCompileNode(struct regex *re, struct reParser *ps, int a, int next) {
+  struct reAst *ast = &ps->ast[a];
+  int s, body;
+  if (re->n > RE_MAX_NODES) return next;
+  switch (ast->op) {
+    case RE_SET:
+      s = reEmit(re, RE_SET, next, -1);
+      memcpy(re->nodes[s].set, ps->ast[a].set, 32);
+      return s;
+    case RE_CAT:
+      return reCompileNode(re, ps, ast->left,
+                           reCompileNode(re, ps, ps->ast[a].right, next));
+    case RE_ALT:
+      body = reCompileNode(re, ps, ast->left, next);
+      return reEmit(re, RE_SPLIT, body,
+                    reCompileNode(re, ps, ps->ast[a].right, next));
+    case RE_STAR:
+    case RE_PLUS:
+      s = reEmit(re, RE_SPLIT, -1, next);
+      body = reCompileNode(re, ps, ps->ast[a].left, s);
+      re->nodes[s].out = body;
+      return ps->ast[a].op == RE_STAR ? s : body;
+    case RE_QUEST:
+      body = reCompileNode(re, ps, ast->left, next);
+      return reEmit(re, RE_SPLIT, body, next);
+    case RE_BOL:
+    case RE_EOL:
+      return reEmit(re, ast->op, next, -1);
+    case RE_REPEAT: {
+      // The operand is compiled once per copy: first the optional copies,
+      // each of which may skip the rest, then the required ones
+      int min = ast->min, max = ast->max, left = ast->left;
+      if (max == -1) {
+        s = reEmit(re, RE_SPLIT, -1, next);
+        body = reCompileNode(re, ps, left, s);
+        re->nodes[s].out = body;
+        next = s;
+      } else {
+        for (int k = min; k < max; k++) {
+          body = reCompileNode(re, ps, left, next);
+          next = reEmit(re, RE_SPLIT, body, next);
+        }
+      }
+      for (int k = 0; k < min; k++) next = reCompileNode(re, ps, left, next);
+      return next;
+    }
+  }
+  return next;
+}
+
+/**
+ * @brief Compiles a regular expression
+ * 
+ * Supports bytes, ., bracket expressions with POSIX classes, \d \w \s and
+ * their negations, grouping, |, *, +, ?, {m,n} intervals, and ^ and $
+ * anywhere, as assertions that hold at the start and end of the row.
+ * Matching ignores case unless the expression has an uppercase letter.
+ * Returns NULL if the expression is not valid, which is normal while it is
+ * being typed.
+ * 
+ * @param query the expression
+ */
+struct regex *regexCompile(const char *query) {
+  static int ids;
+  struct regex *re = calloc(1, sizeof(*re));
+  if (re == NULL) die("calloc");
+  re->id = ++ids;
+
+  struct reParser ps = {query, 1, NULL, 0, 0};
+  for (const char *q = query; *q; q++) {
+    if (*q == '\\' && q[1]) q++;
+    else if (isupper((unsigned char)*q)) ps.icase = 0;
+  }
+
+  int a = reParseAlt(&ps);
+  if (a != -1 && *ps.p == '\0') {
+    int match = reEmit(re, RE_MATCH, -1, -1);
+    re->start = reCompileNode(re, &ps, a, match);
+  }
+  if (a == -1 || *ps.p != '\0' || re->n > RE_MAX_NODES) {
+    free(re->nodes);
+    free(re);
+    re = NULL;
+  }
+  free(ps.ast);
+  return re;
+}
+
+/**
+ * @brief Frees a DFA cache
+ * 
+ * @param d the cache
+ */
+void regexDfaFree(struct regexDfa *d) {
+  for (int i = 0; i < d->n; i++) free(d->states[i].nodes);
+  free(d->states);
+  free(d->trans);
+  free(d->table);
+  free(d->mark);
+  free(d->scratch);
+  memset(d, 0, sizeof(*d));
+}
+
+/**
+ * @brief Frees a compiled regex
+ * 
+ * @param re the regex
+ */
+void regexFree(struct regex *re) {
+  if (re == NULL) return;
+  regexDfaFree(&re->dfa);
+  free(re->nodes);
+  free(re);
+}
+
+/**
+ * @brief Adds an instruction and everything reachable from it without
+ * consuming a byte to the set being built
+ * 
+ * RE_BOL is passed only at the start of the row. RE_EOL stays in the set
+ * as it is, since whether the row ends here is only known once the next
+ * byte is looked at.
+ * 
+ * @param re the regex
+ * @param d the cache holding the set in scratch
+ * @param n the size of the set, increased by what was added
+ * @param i the instruction
+ * @param bol whether this is the start of the row
+ */
+void regexClosure(struct regex *re, struct regexDfa *d, int *n, int i,
+                  int bol) {
+  while (i != -1 && d->mark[i] != d->stamp) {
+    d->mark[i] = d->stamp;
+    int op = re->nodes[i].op;
+    if (op == RE_BOL) {
+      if (!bol) return;
+      i = re->nodes[i].out;
+      continue;
+    }
+    if (op != RE_SPLIT) {
+      d->scratch[(*n)++] = i;
+      return;
+    }
+    regexClosure(re, d, n, re->nodes[i].out, bol);
+    i = re->nodes[i].out1;
+  }
+}
+
+/**
+ * @brief Checks whether an instruction reaches RE_MATCH at the end of a row
+ * without consuming a byte
+ * 
+ * The row is not empty, so RE_BOL never holds here.
+ * 
+ * @param re the regex
+ * @param d the cache, whose marks are used
+ * @param i the instruction
+ */
+int regexEolReach(struct regex *re, struct regexDfa *d, int i) {
+  while (i != -1 && d->mark[i] != d->stamp) {
+    d->mark[i] = d->stamp;
+    struct reNode *node = &re->nodes[i];
+    if (node->op == RE_MATCH) return 1;
+    if (node->op == RE_SPLIT && regexEolReach(re, d, node->out)) return 1;
+    if (node->op != RE_SPLIT && node->op != RE_EOL) return 0;
+    i = node->op == RE_SPLIT ? node->out1 : node->out;
+  }
+  return 0;
+}
+
+/**
+ * @brief Orders instruction indexes
+ */
+int regexIntCmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief Returns the state for the set in scratch, adding it if it is new
+ * 
+ * @param re the regex
+ * @param d the cache
+ * @param n the size of the set
+ */
+int regexDfaIntern(struct regex *re, struct regexDfa *d, int n) {
+  qsort(d->scratch, n, sizeof(int), regexIntCmp);
+  unsigned h = 2166136261u;
+  for (int i = 0; i < n; i++) h = (h ^ d->scratch[i]) * 16777619u;
+
+  int slot = h & (KILO_REGEX_DFA_STATES * 2 - 1);
+  while (d->table[slot] != -1) {
+    struct dfaState *st = &d->states[d->table[slot]];
+    if (st->n == n && memcmp(st->nodes, d->scratch, sizeof(int) * n) == 0)
+      return d->table[slot];
+    slot = (slot + 1) & (KILO_REGEX_DFA_STATES * 2 - 1);
+  }
+
+  struct dfaState *st = &d->states[d->n];
+  st->nodes = malloc(sizeof(int) * (n ? n : 1));
+  if (st->nodes == NULL) die("malloc");
+  memcpy(st->nodes, d->scratch, sizeof(int) * n);
+  st->n = n;
+  st->match = 0;
+  st->eolmatch = 0;
+  d->stamp++;
+  for (int i = 0; i < n; i++) {
+    struct reNode *node = &re->nodes[st->nodes[i]];
+    if (node->op == RE_MATCH) st->match = 1;
+    if (node->op == RE_EOL && regexEolReach(re, d, node->out))
+      st->eolmatch = 1;
+  }
+  st->eolmatch |= st->match;
+  for (int c = 0; c < 256; c++) d->trans[d->n * 256 + c] = -1;
+  d->table[slot] = d->n;
+  return d->n++;
+}
+
+/**
+ * @brief Empties a DFA cache, keeping only the start state
+ * 
+ * Also prepares a cache that was never used, or was built for another
+ * regex.
+ * 
+ * @param re the regex
+ * @param d the cache
+ */
+void regexDfaReset(struct regex *re, struct regexDfa *d) {
+  if (d->id != re->id) {
+    regexDfaFree(d);
+    d->id = re->id;
+    d->states = malloc(sizeof(*d->states) * KILO_REGEX_DFA_STATES);
+    d->trans = malloc(sizeof(int) * KILO_REGEX_DFA_STATES * 256);
+    d->table = malloc(sizeof(int) * KILO_REGEX_DFA_STATES * 2);
+    d->mark = calloc(re->n, sizeof(int));
+    d->scratch = malloc(sizeof(int) * re->n);
+    if (!d->states || !d->trans || !d->table || !d->mark || !d->scratch)
+      die("malloc");
+  }
+  for (int i = 0; i < d->n; i++) free(d->states[i].nodes);
+  d->n = 0;
+  for (int i = 0; i < KILO_REGEX_DFA_STATES * 2; i++) d->table[i] = -1;
+
+  int n = 0;
+  d->stamp++;
+  regexClosure(re, d, &n, re->start, 1);
+  d->start = regexDfaIntern(re, d, n);
+  n = 0;
+  d->stamp++;
+  regexClosure(re, d, &n, re->start, 0);
+  d->restart = regexDfaIntern(re, d, n);
+
+  // Any byte no instruction of the restart state consumes leads straight
+  // back to it, so scans can skip to the bytes that do
+  unsigned char leave[32] = {0};
+  struct dfaState *st = &d->states[d->restart];
+  for (int i = 0; i < st->n; i++) {
+    struct reNode *node = &re->nodes[st->nodes[i]];
+    if (node->op != RE_SET) continue;
+    for (int k = 0; k < 32; k++) leave[k] |= node->set[k];
+  }
+  d->naccel = 0;
+  for (int c = 0; c < 256 && st->n && d->naccel <= 4; c++) {
+    if (!(leave[c >> 3] & (1 << (c & 7)))) continue;
+    if (d->naccel < 4) d->accel[d->naccel] = c;
+    d->naccel++;
+  }
+  if (d->naccel > 4) d->naccel = 0;
+}
+
+/**
+ * @brief Builds the state a byte leads to from a state
+ * 
+ * A match may begin after any byte, so the start instruction joins every
+ * set, where any ^ it starts with fails. Returns the new state, which may
+ * be all that is left if the cache had to be emptied.
+ * 
+ * @param re the regex
+ * @param d the cache
+ * @param from the state
+ * @param c the byte
+ */
+int regexDfaStep(struct regex *re, struct regexDfa *d, int from, int c) {
+  struct dfaState *st = &d->states[from];
+  int n = 0;
+  d->stamp++;
+  for (int i = 0; i < st->n; i++) {
+    struct reNode *node = &re->nodes[st->nodes[i]];
+    if (node->op == RE_SET && (node->set[c >> 3] & (1 << (c & 7))))
+      regexClosure(re, d, &n, node->out, 0);
+  }
+  regexClosure(re, d, &n, re->start, 0);
+
+  if (d->n == KILO_REGEX_DFA_STATES) {
+    // Keep the new set across the reset, which rebuilds the start state
+    int *set = malloc(sizeof(int) * (n ? n : 1));
+    if (set == NULL) die("malloc");
+    memcpy(set, d->scratch, sizeof(int) * n);
+    regexDfaReset(re, d);
+    memcpy(d->scratch, set, sizeof(int) * n);
+    free(set);
+    return regexDfaIntern(re, d, n);
+  }
+
+  int to = regexDfaIntern(re, d, n);
+  st = &d->states[to];
+  int stop = st->match || st->n == 0 || (to == d->restart && d->naccel);
+  d->trans[from * 256 + c] = stop ? -2 - to : to * 256;
+  return to;
+}
+
+/**
+ * @brief Returns the offset of the next byte that leaves the start state
+ * 
+ * @param d the cache
+ * @param s the text of the row
+ * @param i the offset to start at
+ * @param size the length of the text
+ */
+int regexDfaSkip(struct regexDfa *d, const unsigned char *s, int i, int size) {
+#ifdef KILO_HAVE_SSE2
+  __m128i a0 = _mm_set1_epi8(d->accel[0]);
+  __m128i a1 = _mm_set1_epi8(d->accel[d->naccel > 1 ? 1 : 0]);
+  __m128i a2 = _mm_set1_epi8(d->accel[d->naccel > 2 ? 2 : 0]);
+  __m128i a3 = _mm_set1_epi8(d->accel[d->naccel > 3 ? 3 : 0]);
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, a0), _mm_cmpeq_epi8(v, a1)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, a2), _mm_cmpeq_epi8(v, a3)));
+    unsigned mask = _mm_movemask_epi8(hit);
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < size; i++) {
+    for (int k = 0; k < d->naccel; k++)
+      if (s[i] == d->accel[k]) return i;
+  }
+  return size;
+}
+
+int regexSpan(struct regex *re, const unsigned char *s, int size, int from,
+              int *end);
+
+/**
+ * @brief Checks whether a regex matches anywhere in a row
+ * 
+ * Runs the DFA over the row, one table lookup per byte, and stops at the
+ * first byte that completes a match. Stretches of the row that cannot start
+ * a match are skipped without running the DFA at all.
+ * 
+ * @param re the regex
+ * @param d the DFA cache of the calling thread
+ * @param s the text of the row
+ * @param size the length of the text
+ */
+int regexMatch(struct regex *re, struct regexDfa *d, const unsigned char *s,
+               int size) {
+  // An empty row is the one place ^ and $ both hold
+  if (size == 0) {
+    int end;
+    return regexSpan(re, s, 0, 0, &end) != -1;
+  }
+  if (d->id != re->id) regexDfaReset(re, d);
+  int st = d->start, i = 0;
+  while (1) {
+    if (d->states[st].match) return 1;
+    if (d->states[st].n == 0) return 0;
+    if (st == d->restart && d->naccel) i = regexDfaSkip(d, s, i, size);
+
+    // The common case: ordinary states already built
+    const int *trans = d->trans;
+    int at = st * 256, to = 0;
+    while (i < size && (to = trans[at + s[i]]) >= 0) {
+      at = to;
+      i++;
+    }
+    st = at / 256;
+    if (i == size) return d->states[st].eolmatch;
+    st = to == -1 ? regexDfaStep(re, d, st, s[i]) : -2 - to;
+    i++;
+  }
+}
+
+/**
+ * @brief Adds a thread and the instructions reachable from it to a list
+ * 
+ * Each instruction holds at most one thread, and the first to arrive keeps
+ * it. Callers add threads in order of their start, so that is the earliest.
+ * Threads pass RE_BOL and RE_EOL only at the start and end of the row.
+ * 
+ * @param re the regex
+ * @param list the instructions of the threads, in priority order
+ * @param starts where the thread on each instruction started
+ * @param n the length of list
+ * @param mark the list each instruction was last added to
+ * @param stamp the current list
+ * @param i the instruction
+ * @param start where the thread started
+ * @param at the flags of the position: 1 at the start of the row, 2 at the
+ * end
+ */
+void regexAddThread(struct regex *re, int *list, int *starts, int *n, int *mark,
+                    int stamp, int i, int start, int at) {
+  while (i != -1 && mark[i] != stamp) {
+    mark[i] = stamp;
+    int op = re->nodes[i].op;
+    if (op == RE_BOL || op == RE_EOL) {
+      if (!(at & (op == RE_BOL ? 1 : 2))) return;
+      i = re->nodes[i].out;
+      continue;
+    }
+    if (op != RE_SPLIT) {
+      list[*n] = i;
+      starts[i] = start;
+      (*n)++;
+      return;
+    }
+    regexAddThread(re, list, starts, n, mark, stamp, re->nodes[i].out, start,
+                   at);
+    i = re->nodes[i].out1;
+  }
+}
+
+/**
+ * @brief Finds the leftmost-longest match of a regex in a row
+ * 
+ * Simulates the NFA directly, with every thread remembering where it
+ * started, which finds where a match starts and ends in time linear in the
+ * row. Returns the start of the match, or -1 if there is none.
+ * 
+ * @param re the regex
+ * @param s the text of the row
+ * @param size the length of the text
+ * @param from the offset to start searching at
+ * @param end set to the end of the match
+ */
+int regexSpan(struct regex *re, const unsigned char *s, int size, int from,
+              int *end) {
+  int *buf = malloc(sizeof(int) * re->n * 5);
+  if (buf == NULL) die("malloc");
+  int *clist = buf, *nlist = buf + re->n, *starts = buf + 2 * re->n;
+  int *nstarts = buf + 3 * re->n, *mark = buf + 4 * re->n;
+  for (int i = 0; i < re->n; i++) mark[i] = -1;
+
+  int cn = 0, best = -1, stamp = 0;
+  *end = -1;
+  for (int i = from; i <= size; i++) {
+    // New threads only start while no match has been found, and last
+    int at = (i == 0) | (i == size) << 1;
+    if (best == -1)
+      regexAddThread(re, clist, starts, &cn, mark, stamp, re->start, i, at);
+    if (cn == 0 && best != -1) break;
+
+    for (int k = 0; k < cn; k++) {
+      int t = clist[k];
+      if (re->nodes[t].op != RE_MATCH) continue;
+      if (best == -1 || starts[t] < best || (starts[t] == best && i > *end)) {
+        best = starts[t];
+        *end = i;
+      }
+    }
+    if (i == size) break;
+
+    int nn = 0;
+    stamp++;
+    at = (i + 1 == size) << 1;
+    for (int k = 0; k < cn; k++) {
+      struct reNode *node = &re->nodes[clist[k]];
+      if (best != -1 && starts[clist[k]] > best) continue;
+      if (node->op == RE_SET && (node->set[s[i] >> 3] & (1 << (s[i] & 7))))
+        regexAddThread(re, nlist, nstarts, &nn, mark, stamp, node->out,
+                       starts[clist[k]], at);
+    }
+    int *tmp = clist;
+    clist = nlist;
+    nlist = tmp;
+    tmp = starts;
+    starts = nstarts;
+    nstarts = tmp;
+    cn = nn;
+  }
+  free(buf);
+  return best;
+}
+
+/*** find ***/
+
+/** @struct searchPattern
+ *  @brief A search query compiled for scanning rows
+ * 
+ *  Matching is case-insensitive unless the query contains an uppercase
+ * letter. Rather than lowercasing copies of the rows, bytes are folded
+ * through fold while they are compared.
+ * 
+ *  @var foreignstruct::pat
+ *  Member 'pat' the query, already folded when matching ignores case
+ * 
+ *  @var foreignstruct::len
+ *  Member 'len' the length of the query
+ * 
+ *  @var foreignstruct::fold
+ *  Member 'fold' maps each byte to the byte it is compared as
+ * 
+ *  @var foreignstruct::first
+ *  Member 'first' the first byte of the query
+ * 
+ *  @var foreignstruct::last
+ *  Member 'last' the last byte of the query
+ * 
+ *  @var foreignstruct::firstcase
+ *  Member 'firstcase' 0x20 when the first byte is a letter matched in either
+ * case, which or-ing into a byte turns uppercase into lowercase
+ * 
+ *  @var foreignstruct::lastcase
+ *  Member 'lastcase' the same for the last byte
+ * 
+ *  @var foreignstruct::skip
+ *  Member 'skip' the Boyer-Moore-Horspool shift for each byte found under
+ * the last byte of the window
+ * 
+ *  @var foreignstruct::re
+ *  Member 're' the compiled expression when the query is a regex, in which
+ * case the other members are unused and len is 0
+ */
+struct searchPattern {
+  unsigned char *pat;
+  int len;
+  unsigned char fold[256];
+  unsigned char first, last;
+  unsigned char firstcase, lastcase;
+  int skip[256];
+  struct regex *re;
+};
+
+/**
+ * @brief Compiles a query for editorSearchRow() or editorSearchHit()
+ * 
+ * Returns -1 if the query is a regex that is not valid.
+ * 
+ * @param p the pattern to fill
+ * @param query the text to search for
+ * @param regex whether the query is a regular expression
+ */
+int editorSearchCompile(struct searchPattern *p, const char *query, int regex) {
+  p->re = NULL;
+  if (regex) {
+    p->pat = NULL;
+    p->len = 0;
+    p->re = regexCompile(query);
+    return p->re ? 0 : -1;
+  }
+
+  p->len = strlen(query);
+  p->pat = malloc(p->len + 1);
+  if (p->pat == NULL) die("malloc");
+
+  int icase = 1;
+  for (int i = 0; i < p->len; i++)
+    if (isupper((unsigned char)query[i])) icase = 0;
+  for (int c = 0; c < 256; c++) p->fold[c] = icase ? tolower(c) : c;
+  for (int i = 0; i < p->len; i++) p->pat[i] = p->fold[(unsigned char)query[i]];
+  p->pat[p->len] = '\0';
+
+  if (p->len > 0) {
+    p->first = p->pat[0];
+    p->last = p->pat[p->len - 1];
+    p->firstcase = (icase && islower(p->first)) ? 0x20 : 0;
+    p->lastcase = (icase && islower(p->last)) ? 0x20 : 0;
+  }
+
+  for (int c = 0; c < 256; c++) p->skip[c] = p->len;
+  for (int i = 0; i < p->len - 1; i++) {
+    p->skip[p->pat[i]] = p->len - 1 - i;
+    if (icase) p->skip[toupper(p->pat[i])] = p->len - 1 - i;
+  }
+  return 0;
+}
+
+/**
+ * @brief Frees what editorSearchCompile() allocated
+ * 
+ * @param p the pattern
+ */
+void editorSearchFree(struct searchPattern *p) {
+  free(p->pat);
+  p->pat = NULL;
+  regexFree(p->re);
+  p->re = NULL;
+}
+
+/**
+ * @brief Checks whether the pattern matches at a position
+ * 
+ * @param p the pattern
+ * @param s the text to check, at least p->len bytes long
+ */
+int editorSearchMatchAt(struct searchPattern *p, const unsigned char *s) {
+  int i = p->len - 1;
+  while (i >= 0 && p->fold[s[i]] == p->pat[i]) i--;
+  return i < 0;
+}
+
+/**
+ * @brief Finds the first match of a pattern in a row's text
+ * 
+ * With SSE2, 16 windows at a time are tested on their first and last bytes
+ * and only the survivors are compared in full. Without it, and for the tail
+ * of the row, windows are skipped Boyer-Moore-Horspool style. Returns the
+ * offset of the match in chars, or -1 if there is none.
+ * 
+ * @param p the compiled pattern
+ * @param chars the text of the row
+ * @param size the length of the text
+ * @param from the offset to start searching at
+ */
+int editorSearchRow(struct searchPattern *p, const char *chars, int size,
+                    int from) {
+  const unsigned char *s = (const unsigned char *)chars;
+  int len = p->len;
+  if (len == 0 || size - from < len) return -1;
+  int last = size - len;
+  int i = from;
+
+#ifdef KILO_HAVE_SSE2
+  __m128i f = _mm_set1_epi8(p->first), fc = _mm_set1_epi8(p->firstcase);
+  __m128i l = _mm_set1_epi8(p->last), lc = _mm_set1_epi8(p->lastcase);
+  for (; i + 15 <= last; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + len - 1));
+    __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(a, fc), f),
+                                _mm_cmpeq_epi8(_mm_or_si128(b, lc), l));
+    unsigned mask = _mm_movemask_epi8(hit);
+    while (mask) {
+      int k = __builtin_ctz(mask);
+      if (editorSearchMatchAt(p, s + i + k)) return i + k;
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i <= last; i += p->skip[s[i + len - 1]]) {
+    if (editorSearchMatchAt(p, s + i)) return i;
+  }
+  return -1;
+}
+
+/**
+ * @brief Checks whether a pattern matches anywhere in a row's text
+ * 
+ * @param p the compiled pattern
+ * @param dfa the DFA cache of the calling thread, NULL on the main thread
+ * @param chars the text of the row
+ * @param size the length of the text
+ */
+int editorSearchHit(struct searchPattern *p, struct regexDfa *dfa,
+                    const char *chars, int size) {
+  if (p->re == NULL) return editorSearchRow(p, chars, size, 0) != -1;
+  return regexMatch(p->re, dfa ? dfa : &p->re->dfa,
+                    (const unsigned char *)chars, size);
+}
+
+/**
+ * @brief Finds the first match of a pattern in a row's text and its end
+ * 
+ * Returns the offset of the match in chars, or -1 if there is none.
+ * 
+ * @param p the compiled pattern
+ * @param chars the text of the row
+ * @param size the length of the text
+ * @param from the offset to start searching at
+ * @param end set to the offset one past the match
+ */
+int editorSearchSpan(struct searchPattern *p, const char *chars, int size,
+                     int from, int *end) {
+  if (p->re) return regexSpan(p->re, (const unsigned char *)chars, size, from,
+                              end);
+  int at = editorSearchRow(p, chars, size, from);
+  *end = at + p->len;
+  return at;
+}
+
+/** @struct searchRange
+ *  @brief A run of candidate rows searched as one unit of work
+ * 
+ *  @var foreignstruct::lo
+ *  Member 'lo' the index of the first candidate of the run
+ * 
+ *  @var foreignstruct::hi
+ *  Member 'hi' the index one past the last candidate of the run
+ * 
+ *  @var foreignstruct::n
+ *  Member 'n' the number of matching rows, stored from index lo of the
+ * output, or -1 while the run has not been searched yet
+ */
+struct searchRange {
+  int lo, hi;
+  int n;
+};
+
+/** @struct searchJob
+ *  @brief A search handed to the worker pool
+ * 
+ *  The candidates are cut into ranges, ordered by how far they are from the
+ * row the search starts at, so the nearest match is usually found by the
+ * first ranges handed out. The rows are read directly from E.row: the search
+ * prompt is modal, so nothing edits them until every job is finished or
+ * cancelled.
+ * 
+ *  @var foreignstruct::cand
+ *  Member 'cand' the rows to check, NULL for every row
+ * 
+ *  @var foreignstruct::ncand
+ *  Member 'ncand' the number of rows to check
+ * 
+ *  @var foreignstruct::out
+ *  Member 'out' the matching rows, laid out like the candidates
+ * 
+ *  @var foreignstruct::next
+ *  Member 'next' the next range to hand out
+ * 
+ *  @var foreignstruct::busy
+ *  Member 'busy' the number of ranges being searched right now
+ * 
+ *  @var foreignstruct::done
+ *  Member 'done' the number of ranges searched
+ * 
+ *  @var foreignstruct::found
+ *  Member 'found' the number of matching rows found so far
+ */
+struct searchJob {
+  struct searchPattern *pattern;
+  const int *cand;
+  int ncand;
+  int *out;
+  struct searchRange *ranges;
+  int nranges;
+  int next;
+  int busy;
+  int done;
+  int found;
+};
+
+/** @struct searchLevel
+ *  @brief The rows matching one query typed into the search prompt
+ * 
+ *  @var foreignstruct::query
+ *  Member 'query' a private copy of the query
+ * 
+ *  @var foreignstruct::pattern
+ *  Member 'pattern' the query compiled for searching
+ * 
+ *  @var foreignstruct::rows
+ *  Member 'rows' the indexes of the matching rows, in ascending order
+ * 
+ *  @var foreignstruct::n
+ *  Member 'n' the number of matching rows
+ * 
+ *  @var foreignstruct::from
+ *  Member 'from' the row the search started from
+ * 
+ *  @var foreignstruct::direction
+ *  Member 'direction' the direction the search started in
+ * 
+ *  @var foreignstruct::job
+ *  Member 'job' the search still filling in rows, NULL once n is known
+ * 
+ *  @var foreignstruct::cand
+ *  Member 'cand' the rows the trigram index left to check, NULL if the
+ * level was not narrowed down by it
+ */
+struct searchLevel {
+  char *query;
+  struct searchPattern pattern;
+  int *cand;
+  int *rows;
+  int n;
+  int from;
+  int direction;
+  struct searchJob *job;
+};
+
+/** @struct matchSpan
+ *  @brief The render columns a match covers on screen
+ */
+struct matchSpan {
+  int start;
+  int end;
+};
+
+/** @struct search
+ *  @brief The state of the search prompt while it is open
+ * 
+ *  Appending to a query can only remove matches, so each level of the stack
+ * is computed by rechecking only the rows of the level below it. Deleting
+ * from the query pops back to the level that was already computed for it.
+ * 
+ *  @var foreignstruct::levels
+ *  Member 'levels' the stack of match sets, each query extending the one
+ * below it
+ * 
+ *  @var foreignstruct::depth
+ *  Member 'depth' the number of levels in use
+ * 
+ *  @var foreignstruct::threads
+ *  Member 'threads' the worker pool, which lives as long as the prompt
+ * 
+ *  @var foreignstruct::job
+ *  Member 'job' the job the workers take ranges from, guarded by lock
+ * 
+ *  @var foreignstruct::work
+ *  Member 'work' signalled when a job is posted or the pool should stop
+ * 
+ *  @var foreignstruct::finished
+ *  Member 'finished' signalled whenever a range has been searched
+ * 
+ *  @var foreignstruct::spans
+ *  Member 'spans' every match on the visible rows, row by row and sorted
+ * within each row, drawn over the syntax highlighting
+ * 
+ *  @var foreignstruct::rowspans
+ *  Member 'rowspans' the index of the first span of each screen row, plus
+ * one past the last span
+ * 
+ *  @var foreignstruct::shown
+ *  Member 'shown' the match count on screen, to redraw when it changes
+ * 
+ *  @var foreignstruct::regex
+ *  Member 'regex' whether queries are regular expressions, which extending
+ * can match more rows as well as fewer, so levels are never refined
+ */
+struct search {
+  struct searchLevel *levels;
+  int depth;
+  int cap;
+  pthread_t threads[KILO_SEARCH_MAX_THREADS];
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  struct searchJob *job;
+  int stop;
+  struct matchSpan *spans;
+  int spancap;
+  int *rowspans;
+  int rowspancap;
+  int shown;
+  int regex;
+};
+
+/**
+ * @brief Searches one range of candidates if the job has any left
+ * 
+ * Called with the pool lock held, which is dropped while searching. Returns
+ * 0 if there was nothing to take.
+ * 
+ * @param s the search state
+ * @param job the job to take a range from
+ * @param dfa the DFA cache of the calling thread, NULL on the main thread
+ */
+int editorSearchTakeRange(struct search *s, struct searchJob *job,
+                          struct regexDfa *dfa) {
+  if (job->next == job->nranges) return 0;
+  struct searchRange *r = &job->ranges[job->next++];
+  job->busy++;
+  pthread_mutex_unlock(&s->lock);
+
+  int n = 0;
+  for (int i = r->lo; i < r->hi; i++) {
+    int row = job->cand ? job->cand[i] : i;
+
+    // Rows too short to hold the query are rejected without touching them
+    if (E.rowsize[row] < job->pattern->len) continue;
+    if (editorSearchHit(job->pattern, dfa, E.row[row].chars, E.rowsize[row]))
+      job->out[r->lo + n++] = row;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  r->n = n;
+  job->found += n;
+  job->busy--;
+  job->done++;
+  pthread_cond_broadcast(&s->finished);
+  return 1;
+}
+
+/**
+ * @brief Entry point of the search worker threads
+ * 
+ * @param arg the search state
+ */
+void *editorSearchThread(void *arg) {
+  struct search *s = arg;
+  struct regexDfa dfa;
+  memset(&dfa, 0, sizeof(dfa));
+  pthread_mutex_lock(&s->lock);
+  while (!s->stop) {
+    if (s->job == NULL || !editorSearchTakeRange(s, s->job, &dfa))
+      pthread_cond_wait(&s->work, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  regexDfaFree(&dfa);
+  return NULL;
+}
+
+/**
+ * @brief Sets up the search state and its worker pool
+ * 
+ * One worker is started per online CPU. If none can be started the main
+ * thread does all the searching itself while it waits for results.
+ * 
+ * @param regex whether queries are regular expressions
+ */
+struct search *editorSearchOpen(int regex) {
+  struct search *s = calloc(1, sizeof(*s));
+  if (s == NULL) die("calloc");
+  s->regex = regex;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->finished, NULL);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > KILO_SEARCH_MAX_THREADS) cpus = KILO_SEARCH_MAX_THREADS;
+
+  // Leave signals such as SIGWINCH to the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  while (s->nthreads < cpus &&
+         pthread_create(&s->threads[s->nthreads], NULL, editorSearchThread,
+                        s) == 0)
+    s->nthreads++;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return s;
+}
+
+/**
+ * @brief Returns the index of the first candidate at or past a row
+ * 
+ * @param cand the candidate rows in ascending order, NULL for every row
+ * @param ncand the number of candidates
+ * @param row the row to look for
+ */
+int editorSearchBound(const int *cand, int ncand, int row) {
+  if (cand == NULL) return row < 0 ? 0 : (row > ncand ? ncand : row);
+  int lo = 0, hi = ncand;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cand[mid] < row) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief Posts a job that fills in the rows of a new level
+ * 
+ * Ranges start at the first candidate past lv->from in lv->direction and
+ * wrap around the end of the file.
+ * 
+ * @param s the search state
+ * @param lv the level to fill in
+ * @param cand the rows to check, NULL for every row
+ * @param ncand the number of rows to check
+ */
+void editorSearchPost(struct search *s, struct searchLevel *lv,
+                      const int *cand, int ncand) {
+  struct searchJob *job = calloc(1, sizeof(*job));
+  if (job == NULL) die("calloc");
+  job->pattern = &lv->pattern;
+  job->cand = cand;
+  job->ncand = ncand;
+  job->out = lv->rows;
+  int maxranges = ncand / KILO_SEARCH_CHUNK + 2;
+  job->ranges = malloc(sizeof(*job->ranges) * maxranges);
+  if (job->ranges == NULL) die("malloc");
+
+  // Split the candidates where those past from begin, or when moving up,
+  // where those before from end
+  int start = editorSearchBound(cand, ncand,
+                                lv->direction == 1 ? lv->from + 1 : lv->from);
+
+  int n = 0;
+  if (lv->direction == 1) {
+    for (int lo = start; lo < ncand; lo += KILO_SEARCH_CHUNK)
+      job->ranges[n++] = (struct searchRange){lo, lo + KILO_SEARCH_CHUNK, -1};
+    for (int lo = 0; lo < start; lo += KILO_SEARCH_CHUNK)
+      job->ranges[n++] = (struct searchRange){lo, lo + KILO_SEARCH_CHUNK, -1};
+    for (int i = 0; i < n; i++) {
+      int end = job->ranges[i].lo < start ? start : ncand;
+      if (job->ranges[i].hi > end) job->ranges[i].hi = end;
+    }
+  } else {
+    for (int hi = start; hi > 0; hi -= KILO_SEARCH_CHUNK)
+      job->ranges[n++] = (struct searchRange){hi - KILO_SEARCH_CHUNK, hi, -1};
+    for (int hi = ncand; hi > start; hi -= KILO_SEARCH_CHUNK)
+      job->ranges[n++] = (struct searchRange){hi - KILO_SEARCH_CHUNK, hi, -1};
+    for (int i = 0; i < n; i++) {
+      int end = job->ranges[i].hi <= start ? 0 : start;
+      if (job->ranges[i].lo < end) job->ranges[i].lo = end;
+    }
+  }
+  job->nranges = n;
+  lv->job = job;
+
+  pthread_mutex_lock(&s->lock);
+  s->job = job;
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @brief Orders search ranges by their first candidate
+ */
+int editorSearchRangeCmp(const void *a, const void *b) {
+  return ((const struct searchRange *)a)->lo -
+         ((const struct searchRange *)b)->lo;
+}
+
+/**
+ * @brief Frees the job of a level once no worker is using it
+ * 
+ * Called with the pool lock held.
+ * 
+ * @param s the search state
+ * @param lv the level the job belongs to
+ */
+void editorSearchFreeJob(struct search *s, struct searchLevel *lv) {
+  struct searchJob *job = lv->job;
+  if (s->job == job) s->job = NULL;
+  free(job->ranges);
+  free(job);
+  lv->job = NULL;
+}
+
+/**
+ * @brief Turns the output of a finished job into the level's sorted rows
+ * 
+ * Called with the pool lock held, once every range has been searched.
+ * 
+ * @param s the search state
+ * @param lv the level the job belongs to
+ */
+void editorSearchCollect(struct search *s, struct searchLevel *lv) {
+  struct searchJob *job = lv->job;
+  qsort(job->ranges, job->nranges, sizeof(*job->ranges), editorSearchRangeCmp);
+  lv->n = 0;
+  for (int i = 0; i < job->nranges; i++) {
+    struct searchRange *r = &job->ranges[i];
+    memmove(&lv->rows[lv->n], &lv->rows[r->lo], sizeof(int) * r->n);
+    lv->n += r->n;
+  }
+  editorSearchFreeJob(s, lv);
+}
+
+/**
+ * @brief Waits until every row of a level is known
+ * 
+ * The main thread searches ranges itself rather than sitting idle.
+ * 
+ * @param lv the level
+ */
+void editorSearchWait(struct searchLevel *lv) {
+  struct search *s = E.search;
+  if (lv->job == NULL) return;
+  pthread_mutex_lock(&s->lock);
+  while (lv->job->done < lv->job->nranges) {
+    if (!editorSearchTakeRange(s, lv->job, NULL))
+      pthread_cond_wait(&s->finished, &s->lock);
+  }
+  editorSearchCollect(s, lv);
+  pthread_mutex_unlock(&s->lock);
 }
 
 /**
- * @brief Dels a char in a row
+ * @brief Stops the job filling in a level and throws its rows away
  * 
- * @param row a row to delete a char in
- * @param at the index of the char to delete
+ * Ranges already being searched are waited for, the rest are never started.
+ * 
+ * @param lv the level
  */
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+void editorSearchCancel(struct searchLevel *lv) {
+  struct search *s = E.search;
+  if (lv->job == NULL) return;
+  pthread_mutex_lock(&s->lock);
+  lv->job->next = lv->job->nranges;
+  while (lv->job->busy > 0) pthread_cond_wait(&s->finished, &s->lock);
+  editorSearchFreeJob(s, lv);
+  pthread_mutex_unlock(&s->lock);
 }
 
-/*** editor operations ***/
-
 /**
- * @brief Called by editorProcessKeypress() to map a basic char to
- * an operation in the text editor.
- * 
- * Functions in editor operations don't have to worry about the details of modifying an erow
+ * @brief Collects the rest of a search once the workers are done with it
  * 
- * @param c a char c to insert at the location of the cursor
+ * Polled from editorPollEvents() while the editor is idle.
  */
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
-  }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+void editorSearchPoll(void) {
+  struct search *s = E.search;
+  if (s == NULL || s->depth == 0) return;
+  struct searchLevel *lv = &s->levels[s->depth - 1];
+  if (lv->job == NULL) return;
+
+  pthread_mutex_lock(&s->lock);
+  int found = lv->job->found;
+  if (lv->job->done == lv->job->nranges) editorSearchCollect(s, lv);
+  pthread_mutex_unlock(&s->lock);
+
+  // Keep the match count in the status bar streaming
+  if (lv->job == NULL || found != s->shown) editorRefreshScreen();
 }
 
 /**
- * @brief Deletes the cursor at the location of the cursor
+ * @brief Finds the rows matching a query, reusing earlier results
  * 
+ * Pops every level whose query the new one does not extend, cancelling a
+ * search still running for it, then, unless the top level is for this very
+ * query, starts filtering it down into a new level. The new level fills in
+ * on the worker pool while the editor carries on. Returns NULL for an empty
+ * query, which matches nothing, and for a regex that does not compile.
+ * 
+ * @param query the current contents of the prompt
+ * @param from the row to search from, -1 to start at the top
+ * @param direction 1 to search down, -1 to search up
  */
-void editorDelChar(void) {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+struct searchLevel *editorSearchRefine(const char *query, int from,
+                                       int direction) {
+  struct search *s = E.search;
+
+  while (s->depth > 0) {
+    struct searchLevel *top = &s->levels[s->depth - 1];
+    if (strcmp(top->query, query) == 0) return top;
+    if (!s->regex && top->job == NULL &&
+        strncmp(top->query, query, strlen(top->query)) == 0)
+      break;
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    // If the row is empty, delete the whole row
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+    // Partial results cannot be refined further, so they go as well
+    editorSearchCancel(top);
+    free(top->query);
+    editorSearchFree(&top->pattern);
+    free(top->cand);
+    free(top->rows);
+    s->depth--;
+  }
+
+  // An empty level would wrongly rule out every row for the next query
+  if (query[0] == '\0') return NULL;
+  struct searchPattern pattern;
+  if (editorSearchCompile(&pattern, query, s->regex) == -1) return NULL;
+
+  if (s->depth == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 16;
+    s->levels = realloc(s->levels, sizeof(*s->levels) * s->cap);
+    if (s->levels == NULL) die("realloc");
   }
+  struct searchLevel *prev = s->depth > 0 ? &s->levels[s->depth - 1] : NULL;
+  struct searchLevel *lv = &s->levels[s->depth];
+  int candidates = prev ? prev->n : E.numrows;
+  const int *cand = prev ? prev->rows : NULL;
+  lv->cand = NULL;
+  if (prev == NULL && !s->regex) {
+    lv->cand = editorTrigramCandidates(query, &candidates);
+    if (lv->cand) cand = lv->cand;
+  }
+  lv->query = strdup(query);
+  lv->rows = malloc(sizeof(int) * (candidates ? candidates : 1));
+  if (lv->query == NULL || lv->rows == NULL) die("malloc");
+  lv->n = 0;
+  lv->from = from;
+  lv->direction = direction;
+  s->depth++;
+
+  lv->pattern = pattern;
+  editorSearchPost(s, lv, cand, candidates);
+  return lv;
 }
 
 /**
- * @brief Supports the inserting of a new line, if we are at the end
- * of the last line.
+ * @brief Frees the search state once the prompt is closed
  */
-void editorInsertNewline(void) {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+void editorSearchClose(void) {
+  struct search *s = E.search;
+  if (s == NULL) return;
+  for (int i = s->depth - 1; i >= 0; i--) {
+    editorSearchCancel(&s->levels[i]);
+    free(s->levels[i].query);
+    editorSearchFree(&s->levels[i].pattern);
+    free(s->levels[i].cand);
+    free(s->levels[i].rows);
   }
-  E.cy++;
-  E.cx = 0;
-}
 
-/*** file i/o ***/
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+  for (int i = 0; i < s->nthreads; i++) pthread_join(s->threads[i], NULL);
+
+  pthread_cond_destroy(&s->finished);
+  pthread_cond_destroy(&s->work);
+  pthread_mutex_destroy(&s->lock);
+  free(s->spans);
+  free(s->rowspans);
+  free(s->levels);
+  free(s);
+  E.search = NULL;
+}
 
 /**
- * @brief Converts a all the text data to a string that will be written to
- * the disk eventually.
+ * @brief Picks the match to move to from a sorted set of matching rows
  * 
- * @param buflen the length of the textbuffer that needs to be parsed
+ * Returns the index in lv->rows of the first matching row after row in the
+ * given direction, wrapping around the ends of the file.
+ * 
+ * @param lv the matching rows
+ * @param row the row to move away from, -1 to start at the top
+ * @param direction 1 to move down, -1 to move up
  */
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-
-  // Add up the lengths of each row of text, including the newline char
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
-
-  // Allocate the required memory and memcpy the contents of each row to the end of the buffer
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+int editorSearchNext(struct searchLevel *lv, int row, int direction) {
+  // Binary search for the first matching row after row
+  int lo = 0, hi = lv->n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (lv->rows[mid] <= row) lo = mid + 1;
+    else hi = mid;
   }
+  if (direction == 1) return lo < lv->n ? lo : 0;
 
-  // Expect the caller to free memory when it is done
-  return buf;
+  // lo is past row, and past the match on row itself if there is one
+  if (lo > 0 && lv->rows[lo - 1] == row) lo--;
+  return lo > 0 ? lo - 1 : lv->n - 1;
 }
 
 /**
- * @brief Opens a locally stored file by name and reads it line by line.
+ * @brief Returns the nearest matching row in the direction a level was
+ * searched in, or -1 if there is none
  * 
- * Calls the editorInserRow on each line to insert all of the file's text
- * contents into the editor
+ * While the level is still being filled in, this only waits for the ranges
+ * up to the first one holding a match. The rest keep streaming in on the
+ * worker pool.
  * 
- * @param filename the name of the file to open
+ * @param lv the level
  */
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+int editorSearchFirst(struct searchLevel *lv) {
+  struct search *s = E.search;
+  if (lv->job == NULL)
+    return lv->n ? lv->rows[editorSearchNext(lv, lv->from, lv->direction)] : -1;
+
+  struct searchJob *job = lv->job;
+  int row = -1;
+  pthread_mutex_lock(&s->lock);
+  for (int i = 0; i < job->nranges && row == -1; i++) {
+    struct searchRange *r = &job->ranges[i];
+    while (r->n == -1) {
+      if (!editorSearchTakeRange(s, job, NULL))
+        pthread_cond_wait(&s->finished, &s->lock);
+    }
+    if (r->n > 0)
+      row = job->out[lv->direction == 1 ? r->lo : r->lo + r->n - 1];
+  }
+  pthread_mutex_unlock(&s->lock);
+  return row;
+}
 
-  editorSelectSyntaxHighlight();
+/**
+ * @brief Returns the next matching row after a row, or -1 if there is none
+ * 
+ * While the level is still being filled in, its candidates are scanned
+ * directly from row onwards, which stops at the first match instead of
+ * waiting for the whole level.
+ * 
+ * @param lv the level
+ * @param row the row to move away from
+ * @param direction 1 to move down, -1 to move up
+ */
+int editorSearchStep(struct searchLevel *lv, int row, int direction) {
+  if (lv->job == NULL)
+    return lv->n ? lv->rows[editorSearchNext(lv, row, direction)] : -1;
+
+  struct searchJob *job = lv->job;
+  int i = editorSearchBound(job->cand, job->ncand,
+                            direction == 1 ? row + 1 : row);
+  if (direction == -1) i--;
+  for (int k = 0; k < job->ncand; k++, i += direction) {
+    if (i == job->ncand) i = 0;
+    else if (i < 0) i = job->ncand - 1;
+    int r = job->cand ? job->cand[i] : i;
+    if (E.rowsize[r] >= lv->pattern.len &&
+        editorSearchHit(&lv->pattern, NULL, E.row[r].chars, E.rowsize[r]))
+      return r;
+  }
+  return -1;
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+/**
+ * @brief Returns the level for the query in the prompt, NULL if none
+ */
+struct searchLevel *editorSearchTop(void) {
+  if (E.search == NULL || E.search->depth == 0) return NULL;
+  return &E.search->levels[E.search->depth - 1];
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
-  }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+/**
+ * @brief Returns the number of rows matching the query in the prompt
+ * 
+ * @param partial set to whether more matches may still be coming in
+ */
+int editorSearchCount(int *partial) {
+  struct searchLevel *lv = editorSearchTop();
+  *partial = 0;
+  if (lv == NULL) return 0;
+  if (lv->job == NULL) return lv->n;
+
+  pthread_mutex_lock(&E.search->lock);
+  int found = lv->job->found;
+  pthread_mutex_unlock(&E.search->lock);
+  *partial = 1;
+  return found;
 }
 
 /**
- * @brief Either creates a new file and opens it, or modifies the existing
- * file stored in E.filename
+ * @brief Finds every match on the visible rows for editorDrawRows()
  * 
- * TODO: More advanced editors will write to a new, temporary file then rename that
- * file to the actual file the user wants to overwrite. 
+ * Only the rows on screen are searched, so this stays cheap however many
+ * matches the file holds. The spans live in buffers that are reused from
+ * one refresh to the next. Returns 0 when there is nothing to overlay.
  */
-void editorSave(void) {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-    editorSelectSyntaxHighlight();
+int editorSearchOverlay(void) {
+  struct searchLevel *lv = editorSearchTop();
+  if (lv == NULL) return 0;
+  struct search *s = E.search;
+
+  if (s->rowspancap < E.screenrows + 1) {
+    s->rowspancap = E.screenrows + 1;
+    s->rowspans = realloc(s->rowspans, sizeof(int) * s->rowspancap);
+    if (s->rowspans == NULL) die("realloc");
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  // Create a newfile if it doesn't already exist (O_CREAT)
-  // Open the file for reading (O_RDWR)
-  // 0644 contains the mode (permissions) giving the ownder read and write
-  // permissions and everyone else read only
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    // Sets the file's size to the specified length, and cut off any
-    // excess data
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+  int n = 0;
+  for (int y = 0; y < E.screenrows; y++) {
+    s->rowspans[y] = n;
+    int filerow = y + E.rowoff;
+    if (filerow >= E.numrows) continue;
+    erow *row = &E.row[filerow];
+
+    int at = 0, end;
+    while ((at = editorSearchSpan(&lv->pattern, row->chars, row->size, at,
+                                  &end)) != -1) {
+      if (n == s->spancap) {
+        s->spancap = s->spancap ? s->spancap * 2 : 64;
+        s->spans = realloc(s->spans, sizeof(*s->spans) * s->spancap);
+        if (s->spans == NULL) die("realloc");
       }
+      s->spans[n].start = editorRowCxToRx(row, at);
+      s->spans[n].end = editorRowCxToRx(row, end);
+      n++;
+
+      // Regex matches do not overlap, but may be empty
+      at = (lv->pattern.re && end > at) ? end : at + 1;
     }
-    close(fd);
   }
-
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  s->rowspans[E.screenrows] = n;
+  return 1;
 }
 
-/*** find ***/
-
 /**
  * @brief Prompts the user to search for a string in the file.
  * 
- * Linearly scans every line in the text buffer until it finds an 
- * occurance of the user's query, then moves the user cursor to the
+ * Finds the rows holding an occurance of the user's query, refining the
+ * previous results as the query grows, then moves the user cursor to the
  * location of the found query.
+ * 
+ * @param regex whether the query is a regular expression
  */
-void editorFind(void) {
+void editorFind(int regex) {
 
   int saved_cx = E.cx;
   int saved_cy = E.cy;
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-
-  char *query = editorPrompt("Search: %s (ESC/Arrows/Enter)", 
-                              editorFindCallback);
+  E.search = editorSearchOpen(regex);
+  char *query = editorPrompt(regex ? "Regex: %s (ESC/Arrows/Enter)"
+                                   : "Search: %s (ESC/Arrows/Enter)",
+                             editorFindCallback);
+  editorSearchClose();
  
   if (query) {
     free(query);
@@ -945,8 +7571,9 @@ void editorFind(void) {
  * @brief A callback function that is called everytime the user inputs text
  * into the search bar.
  * 
- * Highlights words blue when in search mode, and remembers the previous
- * highlighting data to restore to when we exit search mode.
+ * Moves the cursor to the nearest match. The matches themselves are
+ * highlighted by editorDrawRows() from the search state, which is thrown
+ * away when we exit search mode.
  * 
  * @param query the word we are searching for 
  * @param key the key that the user last pressed
@@ -955,19 +7582,9 @@ void editorFindCallback(char *query, int key) {
   static int last_match = -1;
   static int direction = 1;
 
-  // Save previous highlights to restore on exiting search mode
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
-
-  if (saved_hl)
-
-  // If the user presses Enter or Escape they are leaving search mode
+  // If the user presses Enter or Escape they are leaving search mode; the
+  // search state stays until editorFind() closes it, as an Enter on an
+  // empty prompt does not end the prompt
   if (key == '\r' || key == '\x1b') {
     last_match = -1;
     direction = 1;
@@ -981,36 +7598,101 @@ void editorFindCallback(char *query, int key) {
     direction = 1;
   }
 
-  int i;
-
-  // Loop through each row and check if query is a substring of that row
   if (last_match == -1) direction = 1;
-  int current = last_match;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-    erow *row = &E.row[current];
-
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-
-      // Subtract row->render pointer from match to get cx
-      E.cx = editorRowRxToCx(row, match - row->render);
+  struct searchLevel *lv = editorSearchRefine(query, last_match, direction);
+  if (lv == NULL) return;
+
+  // Jump to the nearest match as soon as it is found, while the rest of the
+  // matches are still coming in
+  int current;
+  if (last_match == -1) current = editorSearchFirst(lv);
+  else current = editorSearchStep(lv, last_match, direction);
+  if (current == -1) return;
+
+  last_match = current;
+  E.cy = current;
+  int end;
+  E.cx = editorSearchSpan(&lv->pattern, E.row[current].chars,
+                          E.row[current].size, 0, &end);
+
+  // Scroll down/up to the word
+  E.rowoff = E.numrows;
+}
 
-      // Scroll down/up to the word
-      E.rowoff = E.numrows;
+/**
+ * @brief Makes sure a growable buffer can hold n bytes
+ * 
+ * @param buf the buffer
+ * @param cap the size of the buffer
+ * @param n the number of bytes needed
+ */
+void editorReplaceReserve(char **buf, size_t *cap, size_t n) {
+  if (n <= *cap) return;
+  size_t c = *cap ? *cap : 256;
+  while (c < n) c *= 2;
+  *buf = realloc(*buf, c);
+  if (*buf == NULL) die("realloc");
+  *cap = c;
+}
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
+/**
+ * @brief Prompts for a string and its replacement, then replaces every
+ * occurrence in the file
+ * 
+ * The matching rows are found by the search workers up front. Each of them
+ * is then rebuilt with all its matches replaced and highlighted once, and
+ * the rows without a match are never touched. The whole replacement is a
+ * single step of the undo history.
+ */
+void editorReplaceAll(void) {
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+  char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+  if (with == NULL) {
+    free(query);
+    return;
+  }
 
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+  E.search = editorSearchOpen(0);
+  struct searchLevel *lv = editorSearchRefine(query, -1, 1);
+  editorSearchWait(lv);
+
+  // Never join the group of an earlier replacement
+  editorUndoClose();
+  editorUndoBegin(UNDO_KIND_REPLACE);
+
+  size_t withlen = strlen(with);
+  char *buf = NULL;
+  size_t cap = 0;
+  long count = 0;
+  for (int i = 0; i < lv->n; i++) {
+    erow *row = &E.row[lv->rows[i]];
+    size_t len = 0;
+    int from = 0, at, end;
+    while ((at = editorSearchSpan(&lv->pattern, row->chars, row->size, from,
+                                  &end)) != -1) {
+      editorReplaceReserve(&buf, &cap, len + (at - from) + withlen);
+      memcpy(buf + len, row->chars + from, at - from);
+      len += at - from;
+      memcpy(buf + len, with, withlen);
+      len += withlen;
+      from = end;
+      count++;
     }
+    editorReplaceReserve(&buf, &cap, len + (row->size - from));
+    memcpy(buf + len, row->chars + from, row->size - from);
+    len += row->size - from;
+    editorRowSet(row, buf, len);
   }
+
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  editorUndoEnd();
+  editorSetStatusMessage("Replaced %ld occurrence%s on %d line%s", count,
+                         count == 1 ? "" : "s", lv->n, lv->n == 1 ? "" : "s");
+  editorSearchClose();
+  free(buf);
+  free(with);
+  free(query);
 }
 
 /*** append buffer ***/
@@ -1045,6 +7727,7 @@ void abAppend(struct abuf *ab, const char *s, int len) {
   // Reallocates a new slot in memory for the string that is large enough
   // to append the new string
   char *new = realloc(ab->b, ab->len + len);
+  E.mem.appends++;
 
   // Copy the current string plus the size of the string we are appending
   if (new == NULL) return;
@@ -1059,9 +7742,161 @@ void abAppend(struct abuf *ab, const char *s, int len) {
  * @param ab a referenece to the append buffer
  */
 void abFree(struct abuf *ab) {
+  E.mem.last = ab->len;
+  E.mem.lastappends = E.mem.appends;
+  E.mem.appends = 0;
+  if (ab->len > E.mem.peak) E.mem.peak = ab->len;
   free(ab->b);
 }
 
+/*** memory ***/
+
+/**
+ * @brief Adds a pool block to a memUsage
+ * 
+ * @param u the memUsage of the block's category
+ * @param p the block
+ * @param used the bytes of the block in use
+ */
+void memAddBlock(struct memUsage *u, void *p, size_t used) {
+  u->bytes += used;
+  u->reserved += rowPoolBlockSize(p);
+  u->allocs++;
+}
+
+/**
+ * @brief Measures the memory of every memCategory
+ * 
+ * The row data is walked rather than counted as it is allocated, so keeping
+ * the numbers costs nothing while editing. A render that is the row's chars
+ * (any row without tabs) costs nothing either and is not counted.
+ * 
+ * @param u an array of MEM_CATEGORIES memUsages to fill in
+ */
+void editorMemUsage(struct memUsage *u) {
+  memset(u, 0, sizeof(*u) * MEM_CATEGORIES);
+  for (int i = 0; i < E.numrows; i++) {
+    erow *row = &E.row[i];
+    memAddBlock(&u[MEM_CHARS], row->chars, row->size + 1);
+    if (row->ntabs)
+      memAddBlock(&u[MEM_RENDER], row->render,
+                  row->rsize + 1 + sizeof(rowTab) * (row->ntabs + 1));
+    if (row->hl) memAddBlock(&u[MEM_HL], row->hl, row->rsize);
+  }
+  for (int i = 0; i < E.nretired; i++)
+    memAddBlock(&u[MEM_RETIRED], E.retired[i],
+                rowPoolCapacity(E.retired[i]));
+
+  size_t perrow = sizeof(erow) + sizeof(int) * 2 + 1 + sizeof(off_t);
+  if (E.rowsig) perrow += sizeof(uint64_t) * KILO_TRIGRAM_WORDS;
+  u[MEM_ROWS].bytes = (long long)perrow * E.numrows;
+  u[MEM_ROWS].reserved = (long long)perrow * E.rowcap;
+  u[MEM_ROWS].allocs = E.rowcap ? (E.rowsig ? 6 : 5) : 0;
+
+  u[MEM_ABUF].bytes = E.mem.last;
+  u[MEM_ABUF].reserved = E.mem.peak;
+  u[MEM_ABUF].allocs = E.mem.lastappends;
+}
+
+/**
+ * @brief Measures the memory the row pool got from malloc
+ * 
+ * @param freebytes set to the bytes sitting in the pool's free lists
+ */
+long long editorMemPool(long long *freebytes) {
+  long long total = 0;
+  for (struct rowPoolSlab *s = E.pool.slabs; s; s = s->next)
+    total += sizeof(*s) + ROWPOOL_SLAB_SIZE;
+  for (struct rowPoolLarge *l = E.pool.large; l; l = l->next)
+    total += sizeof(*l) + 1 + l->cap;
+
+  *freebytes = 0;
+  for (int cls = 0; cls < ROWPOOL_CLASSES; cls++) {
+    char *block = E.pool.free[cls];
+    while (block) {
+      *freebytes += rowPoolClassSize[cls];
+      memcpy(&block, block + 1, sizeof(char *));
+    }
+  }
+  return total;
+}
+
+/**
+ * @brief Returns the resident set size of the editor, or -1 if unknown
+ */
+long long editorMemRss(void) {
+  long long pages = -1;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) return -1;
+  if (fscanf(fp, "%*s %lld", &pages) != 1) pages = -1;
+  fclose(fp);
+  return pages == -1 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Formats a number of bytes with a binary unit
+ */
+void memFormat(char *buf, size_t size, long long bytes) {
+  if (bytes < 1024) snprintf(buf, size, "%lldB", bytes);
+  else if (bytes < 1024 * 1024) snprintf(buf, size, "%.1fK", bytes / 1024.0);
+  else if (bytes < 1024LL * 1024 * 1024)
+    snprintf(buf, size, "%.1fM", bytes / (1024.0 * 1024));
+  else snprintf(buf, size, "%.2fG", bytes / (1024.0 * 1024 * 1024));
+}
+
+const char *memCategoryNames[MEM_CATEGORIES] = {
+  "chars", "render", "hl", "retired", "rows", "abuf"
+};
+
+/**
+ * @brief Shows the memory reserved by each category in the status message
+ * 
+ * The full report, with byte and allocation counts, is printed on exit.
+ */
+void editorMemStatus(void) {
+  struct memUsage u[MEM_CATEGORIES];
+  char msg[sizeof(E.statusmsg)], num[16];
+  int len = 0;
+  editorMemUsage(u);
+  for (int i = 0; i < MEM_CATEGORIES && (size_t)len < sizeof(msg); i++) {
+    memFormat(num, sizeof(num), u[i].reserved);
+    len += snprintf(msg + len, sizeof(msg) - len, "%s %s ",
+                    memCategoryNames[i], num);
+  }
+  long long rss = editorMemRss();
+  memFormat(num, sizeof(num), rss);
+  if (rss != -1 && (size_t)len < sizeof(msg))
+    snprintf(msg + len, sizeof(msg) - len, "rss %s", num);
+  editorSetStatusMessage("%s", msg);
+  E.mem.shown = 1;
+}
+
+/**
+ * @brief Prints the memory of every category to stderr
+ * 
+ * Registered with atexit() before raw mode is entered, so it runs after the
+ * terminal is restored. Only prints after a headless run or once the report
+ * was asked for. For abuf, bytes is the last frame, reserved the largest one
+ * and allocs the reallocations the last frame took.
+ */
+void editorMemReport(void) {
+  if (!E.mem.shown && E.headless == NULL) return;
+  struct memUsage u[MEM_CATEGORIES];
+  editorMemUsage(u);
+  fprintf(stderr, "%-8s %14s %14s %12s\n", "memory", "bytes", "reserved",
+          "allocs");
+  for (int i = 0; i < MEM_CATEGORIES; i++)
+    fprintf(stderr, "%-8s %14lld %14lld %12lld\n", memCategoryNames[i],
+            u[i].bytes, u[i].reserved, u[i].allocs);
+
+  long long freebytes;
+  long long pool = editorMemPool(&freebytes);
+  fprintf(stderr, "%-8s %14s %14lld %12s\n", "pool", "", pool, "");
+  fprintf(stderr, "%-8s %14s %14lld %12s\n", "free", "", freebytes, "");
+  long long rss = editorMemRss();
+  if (rss != -1) fprintf(stderr, "%-8s %14s %14lld %12s\n", "rss", "", rss, "");
+}
+
 /*** output ***/
 
 /**
@@ -1103,6 +7938,7 @@ void editorScroll(void) {
  */
 void editorDrawRows(struct abuf *ab) {
   int y;
+  int overlay = editorSearchOverlay();
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
     if (filerow >= E.numrows) {
@@ -1128,8 +7964,19 @@ void editorDrawRows(struct abuf *ab) {
       char *c = &E.row[filerow].render[E.coloff];
       unsigned char *hl = &E.row[filerow].hl[E.coloff];
       int current_color = -1;
+
+      // Search matches on this row, drawn on top of the highlighting
+      struct matchSpan *span = NULL, *spanend = NULL;
+      if (overlay) {
+        span = &E.search->spans[E.search->rowspans[y]];
+        spanend = &E.search->spans[E.search->rowspans[y + 1]];
+      }
       int j;
       for (j = 0; j < len; j++) {
+        int h = hl[j];
+        while (span < spanend && span->end <= j + E.coloff) span++;
+        if (span < spanend && span->start <= j + E.coloff) h = HL_MATCH;
+
         if (iscntrl(c[j])) {
           char sym = (c[j] <= 26) ? '@' + c[j] : '?';
           abAppend(ab, "\x1b[7m", 4);
@@ -1140,14 +7987,14 @@ void editorDrawRows(struct abuf *ab) {
             int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
             abAppend(ab, buf, clen);
           }
-        } else if (hl[j] == HL_NORMAL) {
+        } else if (h == HL_NORMAL) {
           if (current_color != -1) {
             abAppend(ab, "\x1b[39m", 5);
             current_color = -1;
           }
           abAppend(ab, &c[j], 1);
         } else {
-          int color = editorSyntaxToColor(hl[j]);
+          int color = editorSyntaxToColor(h);
           if (color != current_color) {
             current_color = color;
             char buf[16];
@@ -1186,14 +8033,23 @@ void editorDrawStatusBar(struct abuf *ab) {
 
   // Uses snprintf to compose a message and store as a C string "status" 
 
-  // Stores the number of lines and the filename
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  // Stores the number of lines and the filename, or the latencies
+  int len = E.latency.show ? editorLatencyStatus(status, sizeof(status)) :
+    snprintf(status, sizeof(status), "%.20s - %d lines %s",
     E.filename ? E.filename : "[No Name]", E.numrows,
     E.dirty ? "(modified)" : ""
     );
 
-  // Stires the current line number
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+  // Stires the current line number, after the match count while searching
+  int partial;
+  int matches = editorSearchCount(&partial);
+  char count[32] = "";
+  if (editorSearchTop()) {
+    snprintf(count, sizeof(count), "%d%s matching line%s | ", matches,
+             partial ? "+" : "", matches == 1 && !partial ? "" : "s");
+    E.search->shown = matches;
+  }
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", count,
     E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
 
   
@@ -1234,6 +8090,8 @@ void editorDrawMessageBar(struct abuf *ab) {
  * Called only after a keypress
  */
 void editorRefreshScreen(void) {
+  editorLatencyKeyEnd();
+
   // Fix the view to allow for scrolling
   editorScroll();
 
@@ -1244,7 +8102,9 @@ void editorRefreshScreen(void) {
   abAppend(&ab, "\x1b[H", 3);
 
   // Draw all the text rows
+  long long start = editorNowNs();
   editorDrawRows(&ab);
+  editorLatencyEnd(LATENCY_DRAW, start);
 
   // Draw the status bar and message
   editorDrawStatusBar(&ab);
@@ -1260,7 +8120,9 @@ void editorRefreshScreen(void) {
   abAppend(&ab, "\x1b[?25h", 6);
 
   // Draw the buffer to the screen and clear the buffer
+  start = editorNowNs();
   write(STDOUT_FILENO, ab.b, ab.len);
+  editorLatencyEnd(LATENCY_FLUSH, start);
   abFree(&ab);
 }
 
@@ -1303,6 +8165,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     // Await a response from the user
     int c = editorReadKey();
+    editorLatencyKeyStart();
 
     // Allow for the user to backspace within the prompt
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1392,6 +8255,7 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress(void) {
   static int quit_times = KILO_QUIT_TIMES;
   int c = editorReadKey();
+  editorLatencyKeyStart();
 
   switch (c) {
     // Enter key
@@ -1406,6 +8270,10 @@ void editorProcessKeypress(void) {
         quit_times--;
         return;
       }
+      // Let a running save finish instead of leaving a temporary file behind
+      editorWaitSave();
+      // The edits are either saved or deliberately thrown away by now
+      editorJournalClose(1);
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -1426,7 +8294,35 @@ void editorProcessKeypress(void) {
       break;
 
     case CTRL_KEY('f'):
-      editorFind();
+      editorFind(0);
+      break;
+
+    case CTRL_KEY('r'):
+      editorFind(1);
+      break;
+
+    case CTRL_KEY('e'):
+      editorReplaceAll();
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
+    case CTRL_KEY('t'):
+      editorLatencyToggle();
+      break;
+
+    case CTRL_KEY('p'):
+      editorTraceDump();
+      break;
+
+    case CTRL_KEY('g'):
+      editorMemStatus();
       break;
 
     case BACKSPACE:
@@ -1472,6 +8368,120 @@ void editorProcessKeypress(void) {
   quit_times = KILO_QUIT_TIMES;
 }
 
+/*** headless ***/
+
+/** @struct headless
+ *  @brief The state of a run driven by a key script instead of a terminal
+ * 
+ *  Keys are read from the script as fast as the editor takes them, so the
+ * time from one key being read to the next is the time the editor spent
+ * handling the first one and redrawing the screen after it.
+ * 
+ *  @var foreignstruct::lat
+ *  Member 'lat' the time each key took, in nanoseconds
+ * 
+ *  @var foreignstruct::last
+ *  Member 'last' when the previous key was read, 0 before the first one
+ * 
+ *  @var foreignstruct::open
+ *  Member 'open' the time opening the file took, in nanoseconds
+ */
+struct headless {
+  long long *lat;
+  int n;
+  int cap;
+  long long last;
+  long long open;
+};
+
+/**
+ * @brief Orders latencies
+ */
+int editorHeadlessCmp(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Prints the key latencies of the run to stderr
+ * 
+ * Registered with atexit(), so it runs however the script ends.
+ */
+void editorHeadlessReport(void) {
+  struct headless *h = E.headless;
+  if (h->n > 0) {
+    qsort(h->lat, h->n, sizeof(*h->lat), editorHeadlessCmp);
+    long long total = 0;
+    for (int i = 0; i < h->n; i++) total += h->lat[i];
+    fprintf(stderr, "keys %d  p50 %.1f us  p90 %.1f us  p99 %.1f us  "
+            "max %.1f us  total %.1f ms\n", h->n,
+            h->lat[h->n / 2] / 1e3, h->lat[(int)(h->n * 0.9)] / 1e3,
+            h->lat[(int)(h->n * 0.99)] / 1e3, h->lat[h->n - 1] / 1e3,
+            total / 1e6);
+  }
+  if (h->open) fprintf(stderr, "open %.1f ms\n", h->open / 1e6);
+  if (E.statusmsg[0]) fprintf(stderr, "status: %s\n", E.statusmsg);
+}
+
+/**
+ * @brief Switches to headless mode
+ * 
+ * The script is read in place of the terminal and the screen is drawn into
+ * the capture file, or thrown away. Keys are the bytes a terminal would
+ * send, so arrows are escape sequences and a lone escape must not be
+ * followed by '[' or 'O'.
+ * 
+ * @param script the file of keys to replay
+ * @param capture the file to draw the screen into, NULL for none
+ */
+void editorHeadlessStart(const char *script, const char *capture) {
+  int in = open(script, O_RDONLY);
+  if (in == -1) die(script);
+  int out = capture ? open(capture, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                    : open("/dev/null", O_WRONLY);
+  if (out == -1) die(capture ? capture : "/dev/null");
+  if (dup2(in, STDIN_FILENO) == -1 || dup2(out, STDOUT_FILENO) == -1)
+    die("dup2");
+  close(in);
+  close(out);
+
+  E.headless = calloc(1, sizeof(*E.headless));
+  if (E.headless == NULL) die("calloc");
+  atexit(editorHeadlessReport);
+}
+
+/**
+ * @brief Accounts for the key handled since the previous one was read
+ * 
+ * Called by editorReadKey() before each key. The background work a
+ * terminal session gets to do between keys happens here too, outside the
+ * time measured.
+ */
+void editorHeadlessKey(void) {
+  struct headless *h = E.headless;
+  if (h->last) {
+    if (h->n == h->cap) {
+      h->cap = h->cap ? h->cap * 2 : 4096;
+      h->lat = realloc(h->lat, sizeof(*h->lat) * h->cap);
+      if (h->lat == NULL) die("realloc");
+    }
+    h->lat[h->n++] = editorNowNs() - h->last;
+  }
+  editorPollEvents();
+  h->last = editorNowNs();
+}
+
+/**
+ * @brief Ends a headless run once the script runs out
+ * 
+ * A save still running is waited for, so its outcome is reported.
+ */
+void editorHeadlessFinish(void) {
+  editorWaitSave();
+  editorJournalClose(1);
+  exit(0);
+}
+
 /*** init ***/
 
 /**
@@ -1485,25 +8495,85 @@ void initEditor(void) {
   E.coloff = 0;
   E.numrows = 0;
   E.row = NULL;
+  E.rowsize = NULL;
+  E.rowrsize = NULL;
+  E.rowflags = NULL;
+  E.rowdiskoff = NULL;
+  E.rowcap = 0;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
-
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-  E.screenrows -= 2;
+  E.winch_pending = 0;
+  E.resize_ticks = 0;
+  memset(&E.pool, 0, sizeof(E.pool));
+  E.rowtree = NULL;
+  E.gen = 0;
+  E.snapgen = -1;
+  E.snapshots = 0;
+  E.retired = NULL;
+  E.nretired = 0;
+  E.retiredcap = 0;
+  E.save = NULL;
+  E.disk_valid = 0;
+  E.journal = NULL;
+  memset(&E.undo, 0, sizeof(E.undo));
+  E.undo.budget = KILO_UNDO_BUDGET;
+  E.undo.group = UNDO_NOREC;
+  E.undo.last = UNDO_NOREC;
+  E.search = NULL;
+  E.rowsig = NULL;
+  E.trigram = NULL;
+  memset(&E.latency, 0, sizeof(E.latency));
+  memset(&E.mem, 0, sizeof(E.mem));
+
+  if (editorUpdateWindowSize() == -1) die("getWindowSize");
+
+  // SA_RESTART keeps the blocking writes and reads elsewhere from failing with
+  // EINTR; editorReadKey() notices the resize on its next read timeout
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleSigWinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
 }
 
+// Built without main() by the microbenchmarks, see bench/micro.c
+#ifndef KILO_NO_MAIN
 int main(int argc, char *argv[]) {
-  enableRawMode();
-  initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  char *filename = NULL, *script = NULL, *capture = NULL, *trace = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+      script = argv[++i];
+    else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+      capture = argv[++i];
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      trace = argv[++i];
+    else
+      filename = argv[i];
   }
 
+  atexit(editorMemReport);
+  atexit(editorLatencyReport);
+  if (trace) {
+    editorTraceStart(trace);
+    atexit(editorTraceExit);
+  }
+  if (script) editorHeadlessStart(script, capture);
+  else enableRawMode();
+  initEditor();
+
+  // Set before opening so a journal recovery message can replace it
   editorSetStatusMessage(
-    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F/R = find/regex | "
+    "Ctrl-Z/Y = undo/redo");
+  if (filename) {
+    long long start = editorNowNs();
+    editorOpen(filename);
+    if (E.headless) E.headless->open = editorNowNs() - start;
+  }
 
   while (1) {
     editorRefreshScreen();
@@ -1512,3 +8582,4 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Replays key scripts through kilo's headless mode and fails if any of them
+# makes the editor crash.
+#
+# Usage: tests/run.sh [path to kilo]
+
+KILO=${1:-./kilo}
+DIR=${TMPDIR:-/tmp}/kilo-test.$$
+mkdir -p "$DIR"
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+printf 'alpha\nbeta\n' > "$DIR/file.txt"
+failed=0
+
+# Runs one key script on a fresh copy of the file
+check() {
+  printf "$2" > "$DIR/keys"
+  cp "$DIR/file.txt" "$DIR/work.txt"
+  if "$KILO" --headless "$DIR/keys" "$DIR/work.txt" > /dev/null 2> "$DIR/err"
+  then
+    echo "ok   $1"
+  else
+    echo "FAIL $1"
+    cat "$DIR/err"
+    failed=1
+  fi
+  rm -f "$DIR/work.txt" "$DIR/.work.txt.kilo-journal"
+}
+
+# Keys: Enter is \r, Backspace is \177, Ctrl-F is \006 and Ctrl-R is \022.
+# Enter on an empty prompt keeps the prompt open for the next key.
+check "search: Enter on an empty prompt, then a key" '\006\rX'
+check "search: query erased, Enter, then a key" '\006a\177\rX'
+check "regex: Enter on an empty prompt, then a key" '\022\rX'
+
+exit $failed